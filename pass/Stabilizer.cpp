@@ -5,7 +5,10 @@
 #include <llvm/Constants.h>
 #include <llvm/Intrinsics.h>
 #include <llvm/Instructions.h>
+#include <llvm/LLVMContext.h>
+#include <llvm/Metadata.h>
 
+#include <llvm/Support/CFG.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/TypeBuilder.h>
@@ -29,13 +32,17 @@ enum {
 opt<bool> stabilize_heap   ("stabilize-heap",    init(false), desc("Randomize heap object placement"));
 opt<bool> stabilize_stack  ("stabilize-stack",   init(false), desc("Randomize stack frame placement"));
 opt<bool> stabilize_code   ("stabilize-code",    init(false), desc("Randomize function placement"));
+opt<bool> stabilize_safepoints("stabilize-safepoints", init(false), desc("Poll for re-randomization at function entries and loop heads"));
 
 struct StabilizerPass : public ModulePass {
     static char ID;
 
     Function* registerFunction;
     Function* registerConstructor;
-    Function* registerStackPad;
+    Function* registerStackPads;
+    Function* registerSafepoints;
+    Function* safepoint;
+    GlobalVariable* safepointFlag;
     
     StabilizerPass() : ModulePass(ID) {}
 
@@ -133,6 +140,11 @@ struct StabilizerPass : public ModulePass {
         if(stabilize_heap) {
             randomizeHeap(m);
         }
+        
+        // Register new threads with the runtime so their stacks can be scanned
+        if(stabilize_code) {
+            interceptThreads(m);
+        }
 
         // Build a set of locally-defined functions
         set<Function*> local_functions;
@@ -147,33 +159,57 @@ struct StabilizerPass : public ModulePass {
         
         declareRuntimeFunctions(m);
 
-        map<Function*, GlobalVariable*> stackPads;
+        map<Function*, Constant*> stackPads;
         
-        // Declare the stack pad table type
+        // Declare the stack pad type
 		Type* stackPadType = Type::getInt8Ty(m.getContext());
         
+        // The module's stack pads, one byte per function, packed into whole cache lines
+        GlobalVariable* stackPadTable = NULL;
+        size_t stackPadCount = (local_functions.size() + ALIGN - 1) / ALIGN * ALIGN;
+        
         // Enable stack randomization
         if(stabilize_stack) {
+            ArrayType* stackPadTableType = ArrayType::get(stackPadType, stackPadCount);
+            
+            // Create the stack pad table
+            stackPadTable = new GlobalVariable(
+                m,
+                stackPadTableType,
+                false,
+                GlobalValue::InternalLinkage,
+                ConstantAggregateZero::get(stackPadTableType),
+                "stabilizer.stack_pads"
+            );
+            
+            stackPadTable->setAlignment(ALIGN);
+            
             // Transform each function
+            size_t index = 0;
             for(set<Function*>::iterator f_iter = local_functions.begin(); f_iter != local_functions.end(); f_iter++) {
                 Function* f = *f_iter;
                 
-                // Create the stack pad table
-                GlobalVariable* pad = new GlobalVariable(
-                    m, 
-                    stackPadType, 
-                    false, 
-                    GlobalValue::InternalLinkage,
-                    getInt(m, 8, 0, false),
-                    f->getName()+".stack_pad"
-                );
+                // Give the function the next slot in the table
+                vector<Constant*> indices;
+                indices.push_back(getInt(m, 32, 0, false));
+                indices.push_back(getInt(m, 32, index, false));
+                
+                Constant* pad = ConstantExpr::getGetElementPtr(stackPadTable, indices, true);
                 
                 stackPads[f] = pad;
+                index++;
                 
                 randomizeStack(m, *f, pad);
             }
         }
 
+        // Poll for the end of the epoch, after stack randomization so the polls aren't padded
+        if(stabilize_code && stabilize_safepoints) {
+            for(set<Function*>::iterator f_iter = local_functions.begin(); f_iter != local_functions.end(); f_iter++) {
+                insertSafepoints(m, **f_iter);
+            }
+        }
+
         // Get any existing module constructors
         vector<Value*> old_ctors = getConstructors(m);
         
@@ -208,13 +244,17 @@ struct StabilizerPass : public ModulePass {
             CallInst::Create(registerConstructor, args, "", ctor_bb);
         }
         
-        // If we're not randomizing code, declare the stack tables by themselves
-        if(stabilize_stack && !stabilize_code) {
-            for(map<Function*, GlobalVariable*>::iterator iter = stackPads.begin(); iter != stackPads.end(); iter++) {
-                vector<Value*> args;
-                args.push_back(iter->second);
-                CallInst::Create(registerStackPad, args, "", ctor_bb);
-            }
+        // Register the stack pad table so the runtime can refresh every pad at once
+        if(stabilize_stack) {
+            vector<Value*> args;
+            args.push_back(ConstantExpr::getPointerCast(stackPadTable, Type::getInt8PtrTy(m.getContext())));
+            args.push_back(getIntptr(m, stackPadCount, false));
+            CallInst::Create(registerStackPads, args, "", ctor_bb);
+        }
+        
+        // Tell the runtime to end epochs at polls instead of with traps
+        if(stabilize_code && stabilize_safepoints) {
+            CallInst::Create(registerSafepoints, "", ctor_bb);
         }
         
         ReturnInst::Create(m.getContext(), ctor_bb);
@@ -337,7 +377,7 @@ struct StabilizerPass : public ModulePass {
      * \arg m The module being transformed
      * \arg f The function being transformed
      */
-    void randomizeStack(Module& m, llvm::Function& f, GlobalVariable* stackPad) {
+    void randomizeStack(Module& m, llvm::Function& f, Constant* stackPad) {
         Function* stacksave = Intrinsic::getDeclaration(&m, Intrinsic::stacksave);
         Function* stackrestore = Intrinsic::getDeclaration(&m, Intrinsic::stackrestore);
         
@@ -393,6 +433,100 @@ struct StabilizerPass : public ModulePass {
         }
     }
     
+    /**
+     * \brief Poll for the end of the epoch at a function's entry and at the
+     * head of each of its loops.
+     * 
+     * The runtime's timer sets stabilizer_safepoint_flag instead of placing
+     * traps, and the next poll to see it calls stabilizer_safepoint to end the
+     * epoch.  Every loop has a head, so a running thread reaches a poll within
+     * one loop iteration or one call.
+     * 
+     * \arg m The module being transformed
+     * \arg f The function being transformed
+     */
+    void insertSafepoints(Module& m, Function& f) {
+        // Find loop heads: the targets of edges back to a block on the depth-first path
+        set<BasicBlock*> visited;
+        set<BasicBlock*> onPath;
+        set<BasicBlock*> heads;
+        
+        vector<pair<BasicBlock*, succ_iterator> > path;
+        BasicBlock* entry = &f.getEntryBlock();
+        
+        visited.insert(entry);
+        onPath.insert(entry);
+        path.push_back(make_pair(entry, succ_begin(entry)));
+        
+        while(!path.empty()) {
+            BasicBlock* b = path.back().first;
+            succ_iterator& s = path.back().second;
+            
+            if(s == succ_end(b)) {
+                onPath.erase(b);
+                path.pop_back();
+                continue;
+            }
+            
+            BasicBlock* next = *s;
+            s++;
+            
+            if(onPath.count(next)) {
+                heads.insert(next);
+            } else if(visited.insert(next).second) {
+                onPath.insert(next);
+                path.push_back(make_pair(next, succ_begin(next)));
+            }
+        }
+        
+        // Poll on entry, after the entry block's allocas so they stay static
+        BasicBlock::iterator i = entry->begin();
+        while(isa<AllocaInst>(i)) {
+            i++;
+        }
+        insertPoll(m, entry, i);
+        
+        // Poll at each loop head, after its phis and landing pad
+        for(set<BasicBlock*>::iterator h_iter = heads.begin(); h_iter != heads.end(); h_iter++) {
+            BasicBlock* h = *h_iter;
+            insertPoll(m, h, h->getFirstInsertionPt());
+        }
+    }
+    
+    /**
+     * \brief Split a block and branch to a call to stabilizer_safepoint if the
+     * flag is set.  The block keeps everything before the split point, so
+     * edges into it still reach the poll.
+     * 
+     * \arg m The module being transformed
+     * \arg b The block to poll in
+     * \arg at The first instruction to run after the poll
+     */
+    void insertPoll(Module& m, BasicBlock* b, BasicBlock::iterator at) {
+        LLVMContext& ctx = m.getContext();
+        
+        BasicBlock* rest = b->splitBasicBlock(at, "rest");
+        BasicBlock* poll = BasicBlock::Create(ctx, "poll", b->getParent(), rest);
+        
+        // Replace the unconditional branch left by the split with a check of the flag
+        b->getTerminator()->eraseFromParent();
+        
+        Value* flag = new LoadInst(safepointFlag, "safepoint_flag", true, b);
+        Value* ended = new ICmpInst(*b, ICmpInst::ICMP_NE, flag, getInt(m, 32, 0, false), "epoch_ended");
+        BranchInst* br = BranchInst::Create(poll, rest, ended, b);
+        
+        // The flag is set at most once per epoch, so keep the fall-through on the common path
+        Value* weights[] = {
+            MDString::get(ctx, "branch_weights"),
+            getInt(m, 32, 1, false),
+            getInt(m, 32, 1000, false)
+        };
+        br->setMetadata(LLVMContext::MD_prof, MDNode::get(ctx, weights));
+        
+        CallInst::Create(safepoint, "", poll);
+        BranchInst::Create(rest, poll);
+    }
+    
     /**
      * \brief Transform a function to reference globals only through a relocation table.
      * 
@@ -895,6 +1029,27 @@ struct StabilizerPass : public ModulePass {
         }
     }
     
+    /**
+     * \brief Replace calls to pthread_create with Stabilizer's wrapper, which
+     * registers each new thread with the runtime.
+     * 
+     * \arg m The module to transform
+     */
+    void interceptThreads(Module& m) {
+        Function *pthread_create_fn = m.getFunction("pthread_create");
+        
+        if(pthread_create_fn) {
+            Function *stabilizer_pthread_create = Function::Create(
+                 pthread_create_fn->getFunctionType(),
+                 Function::ExternalLinkage,
+                 "stabilizer_pthread_create",
+                 &m
+            );
+            
+            pthread_create_fn->replaceAllUsesWith(stabilizer_pthread_create);
+        }
+    }
+    
     /**
      * \brief Declare all of Stabilizer's runtime functions
      * \arg m The module to transform
@@ -928,18 +1083,47 @@ struct StabilizerPass : public ModulePass {
         
         registerConstructor->addFnAttr(Attribute::NonLazyBind);
         
-        // Declare the register_stack_table runtime function
+        // Declare the register_stack_pads runtime function
         vector<Type*> params;
 		params.push_back(PointerType::get(Type::getInt8Ty(m.getContext()), 0));
+        params.push_back(getIntptrType(m));
         
-        registerStackPad = Function::Create(
+        registerStackPads = Function::Create(
             FunctionType::get(Type::getVoidTy(m.getContext()), params, false),
             Function::ExternalLinkage,
-            "stabilizer_register_stack_pad",
+            "stabilizer_register_stack_pads",
             &m
         );
         
-        registerStackPad->addFnAttr(Attribute::NonLazyBind);
+        registerStackPads->addFnAttr(Attribute::NonLazyBind);
+        
+        // Declare the safepoint runtime functions and the flag they poll
+        registerSafepoints = Function::Create(
+            TypeBuilder<void(), true>::get(m.getContext()),
+            Function::ExternalLinkage,
+            "stabilizer_register_safepoints",
+            &m
+        );
+        
+        registerSafepoints->addFnAttr(Attribute::NonLazyBind);
+        
+        safepoint = Function::Create(
+            TypeBuilder<void(), true>::get(m.getContext()),
+            Function::ExternalLinkage,
+            "stabilizer_safepoint",
+            &m
+        );
+        
+        safepoint->addFnAttr(Attribute::NonLazyBind);
+        
+        safepointFlag = new GlobalVariable(
+            m,
+            Type::getInt32Ty(m.getContext()),
+            false,
+            GlobalValue::ExternalLinkage,
+            NULL,
+            "stabilizer_safepoint_flag"
+        );
     }
 };
 
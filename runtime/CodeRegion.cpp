@@ -0,0 +1,148 @@
+#include "CodeRegion.h"
+#include "DualMap.h"
+#include "PerfMap.h"
+#include "Stats.h"
+
+CodeRegion* CodeRegion::_current = NULL;
+CodeRegion* CodeRegion::_upcoming = NULL;
+CodeRegion* CodeRegion::_allocating = NULL;
+size_t CodeRegion::_count = 0;
+
+/**
+ * Get the source of mapped chunks for all regions when code is not dual
+ * mapped.  Chunks are mapped low in memory when possible so near jumps can
+ * reach them.
+ */
+static MMapSource<CodeProt, CodeFlags>* getChunkSource() {
+    static char buf[sizeof(MMapSource<CodeProt, CodeFlags>)];
+    static MMapSource<CodeProt, CodeFlags>* _theChunkSource = new (buf) MMapSource<CodeProt, CodeFlags>;
+    return _theChunkSource;
+}
+
+void* CodeRegionSource::malloc(size_t sz) {
+    return CodeRegion::_allocating->grow(sz);
+}
+
+CodeRegion::CodeRegion() : _chunks(NULL), _bump(0), _limit(0), _locations(0) {
+    void* p = Pool<sizeof(CodeRegionHeapType)>::allocate();
+    if(p == NULL) {
+        ABORT("Out of memory for code region heaps");
+    }
+    _heap = new(p) CodeRegionHeapType;
+    _count++;
+}
+
+/**
+ * Release every chunk in the region.  No copies in the region may still be reachable.
+ */
+CodeRegion::~CodeRegion() {
+    _heap->~CodeRegionHeapType();
+    Pool<sizeof(CodeRegionHeapType)>::free(_heap);
+
+    while(_chunks != NULL) {
+        Chunk* c = _chunks;
+        _chunks = c->next;
+        Stats::mapped(Stats::CodeMemory, -(int64_t)c->size);
+        
+        // Addresses in the perf map should not be reused, or perf would give
+        // later code the names of the functions that were here
+        bool retire = PerfMap::reserve(c->size);
+        
+        if(DualMap::enabled()) {
+            DualMap::release(c, retire);
+        } else if(retire) {
+            mmap(c, c->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        } else {
+            munmap(c, c->size);
+        }
+    }
+
+    _count--;
+}
+
+CodeRegion* CodeRegion::current() {
+    if(_current == NULL) {
+        _current = new CodeRegion();
+    }
+    return _current;
+}
+
+CodeRegion* CodeRegion::upcoming() {
+    if(_upcoming == NULL) {
+        _upcoming = new CodeRegion();
+    }
+    return _upcoming;
+}
+
+void CodeRegion::next() {
+    CodeRegion* r = _current;
+    _current = _upcoming;
+    _upcoming = NULL;
+
+    if(r != NULL && r->_locations == 0) {
+        delete r;
+    }
+}
+
+void* CodeRegion::allocate(size_t sz) {
+    _allocating = this;
+    void* p = _heap->malloc(sz);
+    _allocating = NULL;
+
+    if(p != NULL) {
+        _locations++;
+    }
+
+    return p;
+}
+
+void CodeRegion::release() {
+    _locations--;
+
+    if(_locations == 0 && this != _current && this != _upcoming) {
+        delete this;
+    }
+}
+
+/**
+ * Carve memory for the region's heap out of the newest chunk, mapping a new
+ * chunk when it is exhausted.  Requests larger than a chunk get their own.
+ */
+void* CodeRegion::grow(size_t sz) {
+    sz = (sz + CODE_ALIGN - 1) & ~(CODE_ALIGN - 1);
+
+    if(_bump + sz > _limit) {
+        size_t chunkSize = CodeRegionSize;
+        if(sz + CODE_ALIGN > chunkSize) {
+            chunkSize = sz + CODE_ALIGN;
+        }
+
+        // Record the size actually mapped, which is a whole number of pages
+        chunkSize = HugePages::round(chunkSize);
+
+        // The region's heap works in the writable view of dual mapped chunks
+        Chunk* c;
+        if(DualMap::enabled()) {
+            c = (Chunk*)DualMap::allocate(chunkSize, CodeFlags & MAP_32BIT);
+        } else {
+            c = (Chunk*)getChunkSource()->malloc(chunkSize);
+        }
+        
+        if(c == NULL) {
+            return NULL;
+        }
+
+        c->next = _chunks;
+        c->size = chunkSize;
+        _chunks = c;
+        Stats::mapped(Stats::CodeMemory, chunkSize);
+
+        // Keep the chunk header out of the first aligned block
+        _bump = (uintptr_t)c + CODE_ALIGN;
+        _limit = (uintptr_t)c + chunkSize;
+    }
+
+    void* p = (void*)_bump;
+    _bump += sz;
+    return p;
+}
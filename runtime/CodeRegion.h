@@ -0,0 +1,116 @@
+#if !defined(RUNTIME_CODEREGION_H)
+#define RUNTIME_CODEREGION_H
+
+#include "Heap.h"
+#include "Debug.h"
+#include "Pool.h"
+
+struct CodeRegion;
+
+/**
+ * Source heap for the shuffled code heap of one CodeRegion.  Memory comes from
+ * whichever region is currently allocating, and is never freed individually.
+ */
+class CodeRegionSource {
+public:
+    enum { Alignment = CODE_ALIGN };
+
+    void* malloc(size_t sz);
+
+    inline void free(void* p) {}
+};
+
+typedef KingsleyHeap<ShuffleLayer<Random::CodeStream, CodeShuffle, SizeHeap<CodeRegionSource> >, SizeHeap<CodeRegionSource> > CodeRegionHeapType;
+
+/**
+ * The code memory for the function copies made during one epoch.  Copies are
+ * placed by a shuffled heap private to the region, and the region is unmapped
+ * in one step once every copy in it has been collected.  Only the current
+ * region receives new copies, so old regions drain as the frames that return
+ * into them finish.
+ */
+struct CodeRegion {
+private:
+    /// Header at the start of each mapped chunk of the region
+    struct Chunk {
+        Chunk* next;
+        size_t size;
+    };
+
+    Chunk* _chunks;
+    uintptr_t _bump;        //< Next free byte in the newest chunk
+    uintptr_t _limit;       //< End of the newest chunk
+    size_t _locations;      //< The number of function copies in this region that have not been collected
+    CodeRegionHeapType* _heap;
+
+    static CodeRegion* _current;
+    static CodeRegion* _upcoming;
+    static CodeRegion* _allocating;
+    static size_t _count;
+
+    friend class CodeRegionSource;
+
+    CodeRegion();
+    ~CodeRegion();
+
+    void* grow(size_t sz);
+
+public:
+    /**
+     * \brief Allocate CodeRegion objects from a preallocated pool, which is safe in signal handlers
+     * \arg sz The object size
+     */
+    void* operator new(size_t sz) {
+        void* p = Pool<sizeof(CodeRegion)>::allocate();
+        if(p == NULL) {
+            ABORT("Out of memory for CodeRegion objects");
+        }
+        return p;
+    }
+
+    /**
+     * \brief Return an object to its pool
+     * \arg p The object base pointer
+     */
+    void operator delete(void* p) {
+        Pool<sizeof(CodeRegion)>::free(p);
+    }
+
+    /**
+     * \brief Get the region that receives new function copies, creating it if needed
+     */
+    static CodeRegion* current();
+
+    /**
+     * \brief Get the region that will become current at the next epoch, for
+     * copies built ahead of time.  Creates the region if needed.
+     */
+    static CodeRegion* upcoming();
+    
+    /**
+     * \brief Close the current region at the end of an epoch, and make the
+     * upcoming region current.  The closed region is unmapped as soon as it
+     * holds no uncollected copies.
+     */
+    static void next();
+
+    /**
+     * \brief Get the number of mapped regions, including the current one
+     */
+    static inline size_t count() {
+        return _count;
+    }
+
+    /**
+     * \brief Allocate memory for a function copy in this region
+     * \returns The writable view of the memory (see DualMap)
+     */
+    void* allocate(size_t sz);
+
+    /**
+     * \brief Note that a function copy in this region was collected
+     */
+    void release();
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include <vector>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "Config.h"
+#include "Debug.h"
+
+using namespace std;
+
+/**
+ * A setting from the file.  Both strings are copied when the file is read
+ * and never freed.
+ */
+struct Setting {
+    const char* name;
+    const char* value;
+};
+
+typedef vector<Setting> Settings;
+
+static const char Prefix[] = "STABILIZER_";
+
+/**
+ * Read the settings file named by STABILIZER_CONFIG, if there is one
+ */
+static Settings& getFileSettings() {
+    static Settings* _settings = NULL;
+    
+    if(_settings != NULL) {
+        return *_settings;
+    }
+    
+    _settings = new Settings();
+    
+    const char* path = getenv("STABILIZER_CONFIG");
+    if(path == NULL) {
+        return *_settings;
+    }
+    
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        perror("fopen");
+        ABORT("Couldn't read the configuration file %s", path);
+    }
+    
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char* p = line;
+        while(isspace(*p)) {
+            p++;
+        }
+        
+        char* end = p + strlen(p);
+        while(end > p && isspace(end[-1])) {
+            *--end = '\0';
+        }
+        
+        if(*p == '\0' || *p == '#') {
+            continue;
+        }
+        
+        char* eq = strchr(p, '=');
+        if(eq == NULL) {
+            ABORT("Expected NAME=value in %s, found '%s'", path, p);
+        }
+        
+        char* nameEnd = eq;
+        while(nameEnd > p && isspace(nameEnd[-1])) {
+            nameEnd--;
+        }
+        *nameEnd = '\0';
+        
+        char* value = eq + 1;
+        while(isspace(*value)) {
+            value++;
+        }
+        
+        // Store the full name, so lookups are a plain string comparison
+        bool prefixed = strncmp(p, Prefix, sizeof(Prefix) - 1) == 0;
+        char* name = (char*)malloc(sizeof(Prefix) + strlen(p));
+        if(name == NULL) {
+            ABORT("Out of memory reading %s", path);
+        }
+        strcpy(name, prefixed ? "" : Prefix);
+        strcat(name, p);
+        
+        Setting setting;
+        setting.name = name;
+        setting.value = strdup(value);
+        _settings->push_back(setting);
+    }
+    
+    fclose(f);
+    return *_settings;
+}
+
+const char* Config::get(const char* name) {
+    const char* value = getenv(name);
+    if(value != NULL) {
+        return value;
+    }
+    
+    // Later lines override earlier ones.  Searching the array with strcmp
+    // doesn't allocate, so settings can be read from signal handlers.
+    Settings& settings = getFileSettings();
+    for(size_t i=settings.size(); i>0; i--) {
+        if(strcmp(settings[i - 1].name, name) == 0) {
+            return settings[i - 1].value;
+        }
+    }
+    
+    return NULL;
+}
+
+bool Config::flag(const char* name, bool def) {
+    const char* value = get(name);
+    if(value == NULL) {
+        return def;
+    }
+    
+    return strcmp(value, "0") != 0 && strcasecmp(value, "no") != 0
+        && strcasecmp(value, "off") != 0 && strcasecmp(value, "false") != 0;
+}
+
+size_t Config::number(const char* name, size_t def) {
+    const char* value = get(name);
+    if(value == NULL) {
+        return def;
+    }
+    
+    char* end;
+    unsigned long long n = strtoull(value, &end, 0);
+    if(*value == '\0' || *value == '-' || *end != '\0') {
+        ABORT("Invalid value '%s' for %s", value, name);
+    }
+    
+    return (size_t)n;
+}
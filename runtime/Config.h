@@ -0,0 +1,44 @@
+#if !defined(RUNTIME_CONFIG_H)
+#define RUNTIME_CONFIG_H
+
+#include <stddef.h>
+
+/**
+ * Runtime settings, so a stabilized program can be run with different
+ * parameters without rebuilding it.  Every setting is named STABILIZER_*.  A
+ * setting comes from the environment if it is set there, and otherwise from
+ * the file named by STABILIZER_CONFIG, which holds one NAME=value per line.
+ * Names in the file may leave off the STABILIZER_ prefix, and lines starting
+ * with '#' are comments.
+ *
+ * Settings are read on first use, since module constructors allocate and
+ * register stack pads before main runs.  After that, lookups don't allocate
+ * and may be made from signal handlers.
+ */
+struct Config {
+public:
+    /**
+     * \brief Get a setting
+     * \arg name The full name of the setting, such as STABILIZER_SEED
+     * \returns The value, or NULL if the setting is not set
+     */
+    static const char* get(const char* name);
+
+    /**
+     * \brief Get an on/off setting.  "0", "no", "off", and "false" turn a
+     * setting off.  Any other value, even an empty one, turns it on.
+     * \arg name The full name of the setting
+     * \arg def The value if the setting is not set
+     */
+    static bool flag(const char* name, bool def);
+
+    /**
+     * \brief Get a non-negative integer setting.  Aborts if the value is not
+     * a number.
+     * \arg name The full name of the setting
+     * \arg def The value if the setting is not set
+     */
+    static size_t number(const char* name, size_t def);
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include <ucontext.h>
 
 #include "Arch.h"
+#include "Debug.h"
 
 /**
  * A stack walking iterator
@@ -1,10 +1,12 @@
 #if !defined(RUNTIME_DEBUG_H)
 #define RUNTIME_DEBUG_H
 
+#include <stdio.h>
+#include <stdlib.h>
+
 void panic();
 
 #if !defined(NDEBUG)
-#include <stdio.h>
 #include <assert.h>
     #define DEBUG(...) fprintf(stderr, " [%s:%d] ", __FILE__, __LINE__); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n")
 #else
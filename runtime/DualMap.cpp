@@ -0,0 +1,367 @@
+#include "DualMap.h"
+#include "MMapSource.h"
+#include "Debug.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#if IS_LINUX
+#include <fcntl.h>
+#include <link.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#if IS_LINUX && defined(__NR_memfd_create)
+#define HAS_MEMFD 1
+#else
+#define HAS_MEMFD 0
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+bool DualMap::enabled() {
+    static bool _enabled = HAS_MEMFD && Config::flag("STABILIZER_DUALMAP", true);
+    return _enabled;
+}
+
+DualMap::View* DualMap::find(Registry& r, void* p) {
+    Registry::iterator iter = r.upper_bound((uintptr_t)p);
+    
+    if(iter == r.begin()) {
+        return NULL;
+    }
+    
+    iter--;
+    
+    View* v = iter->second;
+    if((uintptr_t)p - iter->first < v->size) {
+        return v;
+    }
+    
+    return NULL;
+}
+
+void DualMap::add(View* v) {
+    getExecutableRegistry()[v->executable] = v;
+    getWritableRegistry()[v->writable] = v;
+}
+
+/**
+ * Extend an arena's file, creating it on first use
+ * \returns The offset of the new range, or -1 on failure
+ */
+off_t DualMap::grow(Arena& a, size_t sz) {
+#if HAS_MEMFD
+    if(a.failed) {
+        return -1;
+    }
+    
+    if(a.fd == -1) {
+        a.fd = syscall(__NR_memfd_create, "stabilizer-code", MFD_CLOEXEC | (a.huge ? MFD_HUGETLB : 0));
+        
+        if(a.fd == -1) {
+            a.failed = true;
+            return -1;
+        }
+    }
+    
+    off_t offset = a.size;
+    
+    if(ftruncate(a.fd, offset + sz) != 0) {
+        return -1;
+    }
+    
+    a.size += sz;
+    return offset;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Map both views of a new range of an arena
+ * \returns The view, or NULL on failure
+ */
+DualMap::View* DualMap::carve(Arena& a, size_t sz, int flags) {
+    off_t offset = grow(a, sz);
+    
+    if(offset == -1) {
+        return NULL;
+    }
+    
+    void* w = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, a.fd, offset);
+    void* x = mmap(NULL, sz, PROT_READ | PROT_EXEC, MAP_SHARED | flags, a.fd, offset);
+    
+    // Fall back to a high address if the low pages are exhausted
+    if(x == MAP_FAILED && (flags & MAP_32BIT)) {
+        x = mmap(NULL, sz, PROT_READ | PROT_EXEC, MAP_SHARED | (flags & ~MAP_32BIT), a.fd, offset);
+    }
+    
+    if(w == MAP_FAILED || x == MAP_FAILED) {
+        if(w != MAP_FAILED) {
+            munmap(w, sz);
+        }
+        if(x != MAP_FAILED) {
+            munmap(x, sz);
+        }
+        
+        // Huge pages are reserved when mapped, so a failure means none are left
+        a.failed = a.huge;
+        return NULL;
+    }
+    
+    View* v = new View();
+    v->executable = (uintptr_t)x;
+    v->writable = (uintptr_t)w;
+    v->size = sz;
+    v->arena = &a;
+    v->offset = offset;
+    return v;
+}
+
+void* DualMap::allocate(size_t sz, int flags) {
+    View* v = NULL;
+    
+    // Reuse a released view of the same size.  All chunks are requested with
+    // the same flags, so its placement is as good as a new one.
+    FreeList& released = getFreeList();
+    FreeList::iterator iter = released.find(sz);
+    
+    if(iter != released.end()) {
+        v = iter->second;
+        released.erase(iter);
+    }
+    
+    if(v == NULL && HugePages::enabled() && sz % HugePages::Size == 0) {
+        v = carve(getArena(true), sz, flags);
+    }
+    
+    if(v == NULL) {
+        v = carve(getArena(false), sz, flags);
+    }
+    
+    if(v == NULL) {
+        return NULL;
+    }
+    
+    add(v);
+    return (void*)v->writable;
+}
+
+void DualMap::release(void* writable, bool retire) {
+    View* v = find(getWritableRegistry(), writable);
+    
+    if(v == NULL) {
+        ABORT("Unmapping code at %p that was not dual mapped", writable);
+    }
+    
+    getWritableRegistry().erase(v->writable);
+    getExecutableRegistry().erase(v->executable);
+    
+#if HAS_MEMFD
+    // Free the pages.  The range reads as zeros until it is reused.
+    fallocate(v->arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, v->offset, v->size);
+#endif
+    
+    if(retire) {
+        munmap((void*)v->writable, v->size);
+        mmap((void*)v->executable, v->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        delete v;
+        return;
+    }
+    
+    getFreeList().insert(pair<const size_t, View*>(v->size, v));
+}
+
+/**
+ * Move a view's contents to a new range of an arena, keeping both addresses
+ * \returns False if the range couldn't be created or mapped
+ */
+bool DualMap::copy(View* v, Arena& a) {
+    off_t offset = grow(a, v->size);
+    
+    if(offset == -1) {
+        return false;
+    }
+    
+    // Fill the new range from the executable view, which still maps the old one
+    void* w = mmap((void*)v->writable, v->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, a.fd, offset);
+    
+    if(w == MAP_FAILED) {
+        return false;
+    }
+    
+    memcpy(w, (void*)v->executable, v->size);
+    
+    void* x = mmap((void*)v->executable, v->size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, a.fd, offset);
+    
+    if(x == MAP_FAILED) {
+        return false;
+    }
+    
+    v->arena = &a;
+    v->offset = offset;
+    return true;
+}
+
+void DualMap::afterForkChild() {
+#if HAS_MEMFD
+    Arena& small = getArena(false);
+    Arena& huge = getArena(true);
+    
+    // Give the child new files.  Its views still map the parent's.
+    int parentFiles[] = { small.fd, huge.fd };
+    small.fd = huge.fd = -1;
+    small.size = huge.size = 0;
+    small.failed = huge.failed = false;
+    
+    // Released views hold no code, so drop them rather than copy them
+    FreeList& released = getFreeList();
+    for(FreeList::iterator iter = released.begin(); iter != released.end(); iter++) {
+        View* v = iter->second;
+        munmap((void*)v->writable, v->size);
+        munmap((void*)v->executable, v->size);
+        delete v;
+    }
+    released.clear();
+    
+    Registry& r = getExecutableRegistry();
+    for(Registry::iterator iter = r.begin(); iter != r.end(); iter++) {
+        View* v = iter->second;
+        
+        if(!(v->arena->huge && copy(v, huge)) && !copy(v, small)) {
+            ABORT("Unable to copy code at %p for a forked child", (void*)v->executable);
+        }
+    }
+    
+    for(size_t i=0; i<sizeof(parentFiles) / sizeof(int); i++) {
+        if(parentFiles[i] != -1) {
+            close(parentFiles[i]);
+        }
+    }
+#endif
+}
+
+#if HAS_MEMFD
+/**
+ * Search state for finding the executable segment that contains an address
+ */
+struct SegmentSearch {
+    uintptr_t p;
+    uintptr_t base;
+    uintptr_t limit;
+};
+
+static int findSegment(struct dl_phdr_info* info, size_t size, void* arg) {
+    SegmentSearch* s = (SegmentSearch*)arg;
+    
+    for(size_t i=0; i<info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        
+        if(ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+            uintptr_t base = info->dlpi_addr + ph->p_vaddr;
+            uintptr_t limit = base + ph->p_memsz;
+            
+            if(s->p >= base && s->p < limit) {
+                s->base = base - base % PAGESIZE;
+                s->limit = (limit + PAGESIZE - 1) & ~((uintptr_t)PAGESIZE - 1);
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+#endif
+
+bool DualMap::remapText(void* p) {
+    if(!enabled()) {
+        return false;
+    }
+    
+    if(find(getExecutableRegistry(), p) != NULL) {
+        return true;
+    }
+    
+#if HAS_MEMFD
+    SegmentSearch s;
+    s.p = (uintptr_t)p;
+    
+    if(dl_iterate_phdr(findSegment, &s) == 0) {
+        DEBUG("No loaded code segment contains %p", p);
+        return false;
+    }
+    
+    size_t sz = s.limit - s.base;
+    Arena& a = getArena(false);
+    off_t offset = grow(a, sz);
+    
+    if(offset == -1) {
+        return false;
+    }
+    
+    void* w = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, a.fd, offset);
+    
+    if(w == MAP_FAILED) {
+        return false;
+    }
+    
+    // Copy the segment, then map the copy over it.  The contents are
+    // identical, so code running in the segment is unaffected.
+    memcpy(w, (void*)s.base, sz);
+    void* x = mmap((void*)s.base, sz, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, a.fd, offset);
+    
+    if(x == MAP_FAILED) {
+        munmap(w, sz);
+        return false;
+    }
+    
+    View* v = new View();
+    v->executable = (uintptr_t)x;
+    v->writable = (uintptr_t)w;
+    v->size = sz;
+    v->arena = &a;
+    v->offset = offset;
+    add(v);
+    
+    DEBUG("Dual mapped code segment %p-%p", (void*)s.base, (void*)s.limit);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void* DualMap::writable(void* p) {
+    View* v = find(getExecutableRegistry(), p);
+    
+    if(v == NULL) {
+        return p;
+    }
+    
+    return (void*)(v->writable + ((uintptr_t)p - v->executable));
+}
+
+void* DualMap::executable(void* p) {
+    View* v = find(getWritableRegistry(), p);
+    
+    if(v == NULL) {
+        return p;
+    }
+    
+    return (void*)(v->executable + ((uintptr_t)p - v->writable));
+}
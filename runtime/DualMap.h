@@ -0,0 +1,157 @@
+#if !defined(RUNTIME_DUALMAP_H)
+#define RUNTIME_DUALMAP_H
+
+#include <map>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "Debug.h"
+#include "Pool.h"
+
+using namespace std;
+
+/**
+ * Code memory mapped twice from a memfd: an executable view that code runs
+ * in, and a writable view used to copy and patch it.  No page is ever both
+ * writable and executable, and patching code needs no protection changes.
+ * 
+ * Dual mapping is used on Linux when memfd_create is available, unless
+ * STABILIZER_DUALMAP=0.  Otherwise code is mapped read/write/execute and both
+ * views are the same address.
+ * 
+ * The views are shared mappings, so a forked child would share its code with
+ * the parent.  afterForkChild() gives the child private copies.
+ */
+struct DualMap {
+private:
+    /**
+     * An anonymous file that code memory is carved out of.  The file is
+     * created once and grows as views are added, so an epoch's code region
+     * costs two mmap calls rather than a new memfd.
+     */
+    struct Arena {
+        int fd;             //< The memfd, or -1 until first use
+        size_t size;        //< Bytes of the file given to views so far
+        bool huge;          //< Whether the file is backed by huge pages
+        bool failed;        //< Set once the file can't be created or mapped
+    };
+    
+    /**
+     * Both views of a range of an arena's file
+     */
+    struct View {
+        uintptr_t executable;
+        uintptr_t writable;
+        size_t size;
+        Arena* arena;
+        off_t offset;       //< The range's offset in the arena's file
+        
+        void* operator new(size_t sz) {
+            void* p = Pool<sizeof(View)>::allocate();
+            if(p == NULL) {
+                ABORT("Out of memory for dual mapped views");
+            }
+            return p;
+        }
+        
+        void operator delete(void* p) {
+            Pool<sizeof(View)>::free(p);
+        }
+    };
+    
+    typedef map<uintptr_t, View*, less<uintptr_t>, PoolAllocator<pair<const uintptr_t, View*> > > Registry;
+    typedef multimap<size_t, View*, less<size_t>, PoolAllocator<pair<const size_t, View*> > > FreeList;
+    
+    /**
+     * \brief Get all views, indexed by executable base address
+     */
+    static inline Registry& getExecutableRegistry() {
+        static Registry _registry;
+        return _registry;
+    }
+    
+    /**
+     * \brief Get all views, indexed by writable base address
+     */
+    static inline Registry& getWritableRegistry() {
+        static Registry _registry;
+        return _registry;
+    }
+    
+    /**
+     * \brief Get released views, indexed by size.  They stay mapped with their
+     * pages freed, and are reused by later allocations of the same size.
+     */
+    static inline FreeList& getFreeList() {
+        static FreeList _free;
+        return _free;
+    }
+    
+    /**
+     * \brief Get the arena for 4KB or huge pages
+     */
+    static inline Arena& getArena(bool huge) {
+        static Arena _small = { -1, 0, false, false };
+        static Arena _huge = { -1, 0, true, false };
+        return huge ? _huge : _small;
+    }
+    
+    static View* find(Registry& r, void* p);
+    static void add(View* v);
+    static off_t grow(Arena& a, size_t sz);
+    static View* carve(Arena& a, size_t sz, int flags);
+    static bool copy(View* v, Arena& a);
+    
+public:
+    /**
+     * \brief Check if code is dual mapped.  The setting is read on first use,
+     * since functions are registered by module constructors before main runs.
+     */
+    static bool enabled();
+    
+    /**
+     * \brief Map new code memory
+     * \arg sz The size of the mapping
+     * \arg flags Extra flags for the executable view, such as MAP_32BIT
+     * \returns The writable view, or NULL on failure
+     */
+    static void* allocate(size_t sz, int flags);
+    
+    /**
+     * \brief Release memory returned by allocate().  Its pages are freed, but
+     * the views stay mapped for reuse.
+     * \arg writable The writable view
+     * \arg retire If true, the executable addresses are never reused.  They
+     * stay reserved with no access instead.
+     */
+    static void release(void* writable, bool retire);
+    
+    /**
+     * \brief Replace the loaded code segment containing p with a dual mapping
+     * of the same contents, so its functions can be patched in place
+     * \returns True if the segment is dual mapped
+     */
+    static bool remapText(void* p);
+    
+    /**
+     * \brief Translate an executable address to its writable view
+     * \returns The writable address, or p if it isn't dual mapped
+     */
+    static void* writable(void* p);
+    
+    /**
+     * \brief Translate a writable address to its executable view
+     * \returns The executable address, or p if it isn't dual mapped
+     */
+    static void* executable(void* p);
+    
+    /**
+     * \brief Give a forked child its own copy of all dual mapped code, so code
+     * it moves or patches is not changed in the parent too.  Installed with
+     * pthread_atfork, and runs while the runtime lock is held.
+     */
+    static void afterForkChild();
+};
+
+#endif
@@ -1,69 +1,130 @@
 #include "Function.h"
 #include "FunctionLocation.h"
+#include "Trace.h"
+#include "Stats.h"
 
 /**
- * Free the current function location and stack pad table
+ * Free the current and spare function locations
  */
 Function::~Function() {
     if(_current != NULL) {
         _current->release();
     }
     
-    if(_stackPad != NULL) {
-        getDataHeap()->free(_stackPad);
+    if(_spare != NULL) {
+        _spare->release();
     }
 }
 
 /**
- * Copy the code and relocation table for this function.  Use the pre-assembled
- * code/table chunk if the function has already been relocated.
+ * Copy the code and relocation table for this function.  Copies are always
+ * made from the original code, since the previous copy's region may already
+ * have been reclaimed.
  * 
  * \arg target The destination of the copy.
  */
 void Function::copyTo(void* target) {
-    if(_current == NULL) {
-        // Copy the code from the original function
-        memcpy(target, _code.base(), _code.size());
-
-        // Patch in the saved header, since the original has been overwritten
-        *(FunctionHeader*)target = _savedHeader;
+    uint64_t ticks = Stats::now();
+    
+    // Copy the code from the original function
+    memcpy(target, _code.base(), _code.size());
 
-        // If there is a stack pad table, move it to a random location
-        if(_stackPad != NULL) {
-            uintptr_t* table = (uintptr_t*)_table.base();
-            for(size_t i=0; i<_table.size(); i+=sizeof(uintptr_t)) {
-                if(table[i] == (uintptr_t)_stackPad) {
-                    _stackPad = (uint8_t*)getDataHeap()->malloc(1);
-                    table[i] = (uintptr_t)_stackPad;
-                }
-            }
-        }
+    // Patch in the saved header, since the original has been overwritten
+    *(FunctionHeader*)target = _savedHeader;
 
-        // Copy the relocation table, if needed
-        if(_tableAdjacent) {
-            uint8_t* a = (uint8_t*)target;
-            memcpy(&a[_code.size()], _table.base(), _table.size());
-        }
-    } else {
-        memcpy(target, _current->_memory.base(), getAllocationSize());
+    // Copy the relocation table, if needed
+    if(_tableAdjacent) {
+        uint8_t* a = (uint8_t*)target;
+        memcpy(&a[_code.size()], _table.base(), _table.size());
     }
+    
+    Stats::add(Stats::Copy, ticks);
 }
 
 /**
- * Create a new FunctionLocation for this Function.
- * \arg relocation The ID for the current relocation phase.
- * \returns Whether or not a new location was created
+ * Move this Function to a new FunctionLocation, using the spare copy if one
+ * was built ahead of time.  Calls are not redirected to the new location
+ * until activate() is called.
+ * \returns The previous location, or NULL if the function had not been relocated
  */
 FunctionLocation* Function::relocate() {
+    uint64_t ticks = Stats::now();
     FunctionLocation* oldLocation = _current;
-    _current = new FunctionLocation(this);
-    _current->activate();
+    
+    if(_spare != NULL) {
+        _current = _spare;
+        _spare = NULL;
+    } else {
+        _current = new FunctionLocation(this, CodeRegion::current());
+    }
+    
+    _relocations++;
+    _idle = 0;
 
-    // Fill the stack pad table with random bytes
-    if(_stackPad != NULL) {
-        // Update random stack pad
-        *_stackPad = getRandomByte();
+    // Each placement of the function gets a new stack pad
+    uint8_t* pad = FunctionTable::get().getPad(_id);
+    if(pad != NULL) {
+        *pad = _current->getPad();
     }
     
+    Trace::move(_code.base(), _current->getBase(), pad != NULL ? _current->getPad() : 0);
+    
+    if(_name != NULL) {
+        PerfMap::add(_current->getBase(), _code.size(), _name);
+    }
+    
+    Stats::add(Stats::Relocate, ticks);
     return oldLocation;
 }
+
+/**
+ * Check if calls can be redirected to the current location without stopping
+ * other threads.
+ */
+bool Function::canActivateAtomically() {
+    FunctionHeader* h = FunctionTable::get().getHeader(_id);
+    return h->canJumpAtomically(_current->getBase(), h);
+}
+
+/**
+ * Redirect calls to the current location.
+ */
+void Function::activate() {
+    _current->activate();
+}
+
+/**
+ * Release the current location once a trap keeps new calls from reaching it.
+ * The function is copied afresh on its next call, so a location that is not
+ * on any stack can be collected along with the rest of its epoch's region.
+ */
+void Function::retire() {
+    if(_current != NULL) {
+        _current->release();
+        _current = NULL;
+    }
+}
+
+/**
+ * Build a spare copy ahead of time, so the next relocation doesn't have to
+ * copy the function.
+ * \arg r The region to hold the copy.  Copies must not be made in r after
+ * the epoch that uses it ends.
+ */
+void Function::prepare(CodeRegion* r) {
+    if(_spare == NULL) {
+        _spare = new FunctionLocation(this, r);
+    }
+}
+
+/**
+ * Release a spare copy that was built in region r, once r stops receiving
+ * copies.  Keeping it would hold the whole region until the function is
+ * called again.
+ */
+void Function::dropSpare(CodeRegion* r) {
+    if(_spare != NULL && _spare->getRegion() == r) {
+        _spare->release();
+        _spare = NULL;
+    }
+}
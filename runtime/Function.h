@@ -7,78 +7,76 @@
 #include "Util.h"
 #include "Jump.h"
 #include "Trap.h"
+#include "FunctionHeader.h"
+#include "FunctionTable.h"
 #include "Heap.h"
+#include "Context.h"
+#include "DualMap.h"
 #include "MemRange.h"
+#include "Pool.h"
+#include "PerfMap.h"
 
 struct Function;
 struct FunctionLocation;
+struct CodeRegion;
 
-struct FunctionHeader {
-private:
-    union {
-        uint8_t _jmp[sizeof(Jump)];
-        uint8_t _trap[sizeof(Trap)];
-    };
-    
-    Function* _f;
-    
+struct Function {
 public:
-    FunctionHeader(Function* f) : _f(f) {}
+    /// Heat added by each timer sample.  Heat halves every epoch, so one
+    /// sample keeps a function hot for four epochs.
+    enum { HeatPerSample = 8 };
     
-    void jumpTo(void* target) {
-        new(_jmp) Jump(target);
-    }
-    
-    void trap() {
-        new(_trap) Trap();
-    }
-    
-    Function* getFunction() {
-        return _f;
-    }
-};
-
-struct Function {
 private:
     friend class FunctionLocation;
     
     MemRange _code;
     MemRange _table;
-    FunctionHeader* _header;
     FunctionHeader _savedHeader;
     
     bool _tableAdjacent;    //< If true, the relocation table should be placed next to the function
     
-    uint8_t* _stackPad;		//< The address of the stack pad value for this function
-    
     FunctionLocation* _current;
+    FunctionLocation* _spare;   //< A copy built ahead of time for the next relocation, or NULL
+    
+    size_t _heat;           //< Recent timer samples in this function, decayed every epoch
+    size_t _samples;        //< Timer samples in this function over the whole run
+    size_t _relocations;    //< The number of times this function has moved
+    size_t _idle;           //< Epochs since this function last moved
+    size_t _id;             //< The function's registration order, which is the same in every run.  Its header, pad, and trap state are in FunctionTable.
+    const char* _name;      //< The name perf shows for this function's copies, or NULL without a perf map
     
     /**
      * \brief Place a jump instruction to forward calls to this function
      * \arg target The destination of the jump instruction
      */
     inline void forward(void* target) {
-        _header->jumpTo(target);
-        flush_icache(_header, sizeof(FunctionHeader));
+        FunctionTable& t = FunctionTable::get();
+        t.getHeaderView(_id)->jumpTo(target, t.getHeader(_id));
+        flush_icache(t.getHeader(_id), sizeof(FunctionHeader));
+        t.trapped().clear(_id);
     }
     
     void copyTo(void* target);
     
 public:
     /**
-     * \brief Allocate Function objects on the randomized heap
+     * \brief Allocate Function objects from a preallocated pool, which is safe in signal handlers
      * \arg sz The object size
      */
     void* operator new(size_t sz) {
-        return getDataHeap()->malloc(sz);
+        void* p = Pool<sizeof(Function)>::allocate();
+        if(p == NULL) {
+            ABORT("Out of memory for Function objects");
+        }
+        return p;
     }
     
     /**
-     * \brief Free allocated memory to the randomized heap
+     * \brief Return an object to its pool
      * \arg p The object base pointer
      */
     void operator delete(void* p) {
-        getDataHeap()->free(p);
+        Pool<sizeof(Function)>::free(p);
     }
     
     /**
@@ -88,24 +86,35 @@ public:
     * \arg tableBase The address of the function's relocation table
     * \arg tableSize The size of the function's relocation table
     * \arg tableAdjacent If true, the relocation table should be placed immediately after the function
-	* \arg stackPad The address of this function's stack pad size
+	* \arg stackPad The address of this function's stack pad in its module's table
     */
     inline Function(void* codeBase, void* codeLimit, void* tableBase, size_t tableSize, bool tableAdjacent, uint8_t* stackPad) :
         _code(codeBase, codeLimit), _table(tableBase, tableSize), _savedHeader(*(FunctionHeader*)_code.base()) {
         
         this->_tableAdjacent = tableAdjacent;
-        this->_stackPad = stackPad;
         this->_current = NULL;
+        this->_spare = NULL;
+        this->_heat = 0;
+        this->_samples = 0;
+        this->_relocations = 0;
+        this->_idle = 0;
+        this->_name = PerfMap::enabled() ? PerfMap::resolve(codeBase) : NULL;
 
-        // Make the function header writable
-        if(mprotect(_code.pageBase(), _code.pageSize(), PROT_READ | PROT_WRITE | PROT_EXEC)) {
-            perror("Unable make code writable");
-            abort();
+        // Patch the function through a writable view of its code, or make the code writable
+        if(!DualMap::remapText(_code.base())) {
+            if(mprotect(_code.pageBase(), _code.pageSize(), PROT_READ | PROT_WRITE | PROT_EXEC)) {
+                perror("Unable make code writable");
+                abort();
+            }
+        } else if(_name != NULL) {
+            // The remapped text is memfd memory, so perf can't name it from the program file
+            PerfMap::add(_code.base(), _code.size(), _name);
         }
         
         // Make a copy of the function header
         _savedHeader = *(FunctionHeader*)_code.base();
-        _header = new(_code.base()) FunctionHeader(this);
+        FunctionHeader* headerView = new(DualMap::writable(_code.base())) FunctionHeader(this);
+        this->_id = FunctionTable::get().add(this, (FunctionHeader*)_code.base(), headerView, stackPad);
     }
     
     /**
@@ -115,11 +124,92 @@ public:
     
     FunctionLocation* relocate();
     
+    bool canActivateAtomically();
+    
+    void activate();
+    
+    void retire();
+    
+    void prepare(CodeRegion* r);
+    
+    void dropSpare(CodeRegion* r);
+    
+    inline bool hasSpare() {
+        return _spare != NULL;
+    }
+    
     /**
-     * \brief Place a trap instruction at the beginning of this function
+     * \brief Place a trap instruction at the beginning of this function.  All
+     * other threads must be stopped.
      */
     inline void setTrap() {
-        _header->trap();
+        FunctionTable::get().setTrap(_id);
+    }
+    
+    inline bool isTrapped() {
+        return FunctionTable::get().isTrapped(_id);
+    }
+    
+    /**
+     * \brief Record a timer sample taken while this function was running
+     */
+    inline void sampled() {
+        _heat += HeatPerSample;
+        _samples++;
+    }
+    
+    /**
+     * \brief Age this function's heat at the end of an epoch
+     */
+    inline void cool() {
+        _heat /= 2;
+    }
+    
+    /**
+     * \brief Note that this function was left in place for an epoch
+     */
+    inline void stay() {
+        _idle++;
+    }
+    
+    inline bool isHot() {
+        return _heat > 0;
+    }
+    
+    inline size_t getSamples() {
+        return _samples;
+    }
+    
+    inline size_t getRelocations() {
+        return _relocations;
+    }
+    
+    inline size_t getIdleEpochs() {
+        return _idle;
+    }
+    
+    inline size_t getId() {
+        return _id;
+    }
+    
+    /**
+     * \brief Move a context that was interrupted partway through this
+     * function's header back to the start of the header, so the header can
+     * be safely rewritten.
+     * \arg c The interrupted context
+     */
+    inline void restartHeader(Context c) {
+        FunctionHeader* h = FunctionTable::get().getHeader(_id);
+        MemRange header(h, sizeof(FunctionHeader));
+        if(header.contains(c.ip()) && c.ip() != h) {
+            // Only the 64 bit x86 jump spans several instructions; undo its stack adjustment
+            _X86_64(
+                if(*(uint32_t*)h == X86Jump64::SubOpcode) {
+                    c.sp() = (void*)((uintptr_t)c.sp() + sizeof(void*));
+                }
+            )
+            c.ip() = h;
+        }
     }
     
     inline void* getCodeBase() {
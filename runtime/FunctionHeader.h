@@ -0,0 +1,63 @@
+#if !defined(RUNTIME_FUNCTIONHEADER_H)
+#define RUNTIME_FUNCTIONHEADER_H
+
+#include <new>
+#include <stdint.h>
+
+#include "Arch.h"
+#include "Jump.h"
+#include "Trap.h"
+
+struct Function;
+
+/**
+ * The first bytes of a registered function, which hold a trap or a jump to the
+ * function's current copy, followed by the function it belongs to
+ */
+struct FunctionHeader {
+private:
+    union {
+        uint8_t _jmp[sizeof(Jump)];
+        uint8_t _trap[sizeof(Trap)];
+    };
+    
+    Function* _f;
+    
+public:
+    FunctionHeader(Function* f) : _f(f) {}
+    
+    /**
+     * \brief Check if a jump to target can be placed with a single atomic store
+     * \arg target The destination of the jump
+     * \arg pc The address this header executes at
+     */
+    bool canJumpAtomically(void* target, void* pc) {
+        _X86_64(return X86_64Jump::isNear(pc, target) && (uintptr_t)pc % sizeof(uint64_t) == 0);
+        return false;
+    }
+    
+    /**
+     * \brief Replace this header with a jump.  Unless canJumpAtomically(target, pc),
+     * all other threads must be stopped.
+     * \arg target The destination of the jump
+     * \arg pc The address this header executes at, which differs from this
+     * header's address when it is written through a writable view
+     */
+    void jumpTo(void* target, void* pc) {
+        if(canJumpAtomically(target, pc)) {
+            _X86_64(X86Jump32::placeAtomic(_jmp, pc, target));
+        } else {
+            new(_jmp) Jump(target, pc);
+        }
+    }
+    
+    void trap() {
+        new(_trap) Trap();
+    }
+    
+    Function* getFunction() {
+        return _f;
+    }
+};
+
+#endif
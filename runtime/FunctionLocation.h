@@ -1,71 +1,183 @@
 #if !defined(RUNTIME_FUNCTIONLOCATION_H)
 #define RUNTIME_FUNCTIONLOCATION_H
 
-#include <set>
+#include <map>
 
 #include "MemRange.h"
 #include "Function.h"
+#include "CodeRegion.h"
+#include "Pool.h"
+#include "Stats.h"
 
 using namespace std;
 
+/**
+ * A copy of a function in a code region.  Copies that are no longer current
+ * are defunct, and are reclaimed by a sweep once no stack references them.
+ *
+ * Defunct copies are swept by generation.  A new defunct copy is young, and
+ * is checked at every sweep.  Most are gone after one epoch, but a copy still
+ * pinned by a long-running frame after OldAge sweeps moves to the old
+ * generation, which is only checked every OldPeriod sweeps.  A sweep then
+ * costs about as much as the epoch's churn, however many copies are pinned.
+ */
 struct FunctionLocation {
 private:
     friend class Function;
     
+    enum {
+        OldAge = 4,         //< Sweeps a defunct copy survives before it is old
+        OldPeriod = 16      //< Sweeps between checks of the old generation
+    };
+    
     Function* _f;
+    CodeRegion* _region;    //< The epoch's code region holding this copy
     MemRange _memory;
     bool _defunct;
-    bool _marked;
+    size_t _marked;         //< The last sweep this copy was marked for
+    size_t _survived;       //< Sweeps survived since this copy became defunct
+    FunctionLocation* _next;    //< The next defunct copy in this copy's generation
+    uint8_t _pad;           //< The function's stack pad while this copy is current
+    
+    typedef map<uintptr_t, FunctionLocation*, less<uintptr_t>, PoolAllocator<pair<const uintptr_t, FunctionLocation*> > > Registry;
+    
+    Registry::iterator _entry;  //< This copy's entry in the registry
     
-    static inline set<FunctionLocation*>& getRegistry() {
-        static set<FunctionLocation*> _registry;
+    /**
+     * \brief Get the index of all live function locations, ordered by base address
+     */
+    static inline Registry& getRegistry() {
+        static Registry _registry;
         return _registry;
     }
     
-    static FunctionLocation* find(void* p) {
-        for(set<FunctionLocation*>::iterator iter = getRegistry().begin(); iter != getRegistry().end(); iter++) {
-            FunctionLocation* l = *iter;
-            if(l->_memory.contains(p)) {
-                return l;
+    /**
+     * \brief Get the number of the next sweep.  Marks made before it are for
+     * this sweep, so marks never have to be cleared.
+     */
+    static inline size_t& getSweeps() {
+        static size_t _sweeps = 1;
+        return _sweeps;
+    }
+    
+    /**
+     * \brief Get the list of defunct copies that are checked every sweep
+     */
+    static inline FunctionLocation*& getYoung() {
+        static FunctionLocation* _young = NULL;
+        return _young;
+    }
+    
+    /**
+     * \brief Get the list of long-pinned defunct copies, checked every OldPeriod sweeps
+     */
+    static inline FunctionLocation*& getOld() {
+        static FunctionLocation* _old = NULL;
+        return _old;
+    }
+    
+    /**
+     * \brief Reclaim the unmarked copies in one generation's list
+     * \arg list The list to sweep
+     * \arg promote The list survivors move to once they are old enough, or
+     * NULL to keep them in place
+     */
+    static void sweepList(FunctionLocation*& list, FunctionLocation** promote) {
+        FunctionLocation** link = &list;
+        
+        while(*link != NULL) {
+            FunctionLocation* l = *link;
+            
+            if(l->_marked != getSweeps()) {
+                *link = l->_next;
+                getRegistry().erase(l->_entry);
+                delete l;
+            } else if(promote != NULL && ++l->_survived >= OldAge) {
+                *link = l->_next;
+                l->_next = *promote;
+                *promote = l;
+            } else {
+                link = &l->_next;
             }
         }
+    }
+    
+    /**
+     * \brief Find the function location containing an address
+     * Locations never overlap, so the only candidate is the location with the
+     * highest base address at or below p.
+     * \arg p The address to look up
+     * \returns The containing location, or NULL if p is not in relocated code
+     */
+    static FunctionLocation* find(void* p) {
+        Registry::iterator iter = getRegistry().upper_bound((uintptr_t)p);
+        
+        if(iter == getRegistry().begin()) {
+            return NULL;
+        }
+        
+        iter--;
+        
+        FunctionLocation* l = iter->second;
+        if(l->_memory.contains(p)) {
+            return l;
+        }
         
         return NULL;
     }
     
 public:
-    FunctionLocation(Function* f) :  _f(f), _memory(getCodeHeap()->malloc(_f->getAllocationSize()), _f->getAllocationSize()) {
+    /**
+     * \brief Copy a function into a code region
+     * \arg f The function to copy
+     * \arg region The region to hold the copy
+     */
+    FunctionLocation(Function* f, CodeRegion* region) :  _f(f), _region(region),
+        _memory(DualMap::executable(_region->allocate(_f->getAllocationSize())), _f->getAllocationSize()) {
         if(_memory.base() == NULL) {
             perror("code malloc");
             ABORT("Couldn't allocate memory for function relocation");
         }
         
         _defunct = false;
-        _marked = false;
+        _marked = 0;
+        _survived = 0;
+        _next = NULL;
+        
+        // Drawn with the placement, so both depend only on the order copies are made in
+        _pad = Random::get(Random::PadStream).nextByte();
         
-        _f->copyTo(_memory.base());
+        _f->copyTo(DualMap::writable(_memory.base()));
         
-        getRegistry().insert(this);
+        _entry = getRegistry().insert(Registry::value_type((uintptr_t)_memory.base(), this)).first;
     }
     
+    /**
+     * \brief Return this copy's memory to its region.  The region is unmapped
+     * once all of its copies are gone.
+     */
     ~FunctionLocation() {
-        getCodeHeap()->free(_memory.base());
+        _region->release();
     }
     
     /**
-     * \brief Allocate FunctionLocation objects on the randomized heap
+     * \brief Allocate FunctionLocation objects from a preallocated pool, which is safe in signal handlers
      * \arg sz The object size
      */
     void* operator new(size_t sz) {
-        return getDataHeap()->malloc(sz);
+        void* p = Pool<sizeof(FunctionLocation)>::allocate();
+        if(p == NULL) {
+            ABORT("Out of memory for FunctionLocation objects");
+        }
+        return p;
     }
     
     /**
-     * \brief Free allocated memory to the randomized heap
+     * \brief Return an object to its pool
      * \arg p The object base pointer
      */
     void operator delete(void* p) {
-        getDataHeap()->free(p);
+        Pool<sizeof(FunctionLocation)>::free(p);
     }
     
     void activate() {
@@ -73,33 +185,90 @@ public:
     }
     
     void release() {
-        _defunct = true;
+        if(!_defunct) {
+            _defunct = true;
+            _next = getYoung();
+            getYoung() = this;
+        }
     }
     
     void* getBase() {
         return _memory.base();
     }
     
+    CodeRegion* getRegion() {
+        return _region;
+    }
+    
+    uint8_t getPad() {
+        return _pad;
+    }
+    
+    static size_t count() {
+        return getRegistry().size();
+    }
+    
+    /**
+     * \brief Find the function whose copy contains an address
+     * \arg p The address to look up
+     * \returns The function, or NULL if p is not in relocated code
+     */
+    static Function* functionAt(void* p) {
+        FunctionLocation* l = find(p);
+        return l != NULL ? l->_f : NULL;
+    }
+    
+    /**
+     * \brief Keep the copy containing an address from being reclaimed by the
+     * next sweep
+     */
     static void mark(void* p) {
         FunctionLocation* l = find(p);
         if(l != NULL) {
-            l->_marked = true;
+            l->_marked = getSweeps();
         }
     }
     
+    /**
+     * \brief Reclaim defunct copies that were not marked since the last
+     * sweep.  Every stack that may reference a copy must have been marked.
+     */
     static void sweep() {
-        set<FunctionLocation*>::iterator iter = getRegistry().begin();
+        uint64_t ticks = Stats::now();
         
-        while(iter != getRegistry().end()) {
-            FunctionLocation* l = *iter;
-            
-            if(l->_defunct && !l->_marked) {
-                getRegistry().erase(iter++);
-                delete l;
-            } else {
-                l->_marked = false;
-                iter++;
-            }
+        if(getSweeps() % OldPeriod == 0) {
+            sweepList(getOld(), NULL);
+        }
+        sweepList(getYoung(), &getOld());
+        
+        getSweeps()++;
+        Stats::add(Stats::Sweep, ticks);
+    }
+    
+    /**
+     * \brief Move a return address out of a defunct copy, so the copy can be
+     * reclaimed while the frame is still live.  Every copy of a function has
+     * the same layout, so the address moves to the same offset in the
+     * function's current copy, or in its original code if it has none.
+     * \arg p A return address
+     * \returns The new return address, or p if it isn't in a defunct copy or
+     * the original code's header covers it
+     */
+    static void* retarget(void* p) {
+        FunctionLocation* l = find(p);
+        if(l == NULL || !l->_defunct) {
+            return p;
+        }
+        
+        size_t offset = l->_memory.offsetOf(p);
+        FunctionLocation* current = l->_f->_current;
+        
+        if(current != NULL) {
+            return current->_memory.offsetIn(offset);
+        } else if(offset >= sizeof(FunctionHeader) && offset < l->_f->_code.size()) {
+            return l->_f->_code.offsetIn(offset);
+        } else {
+            return p;
         }
     }
     
@@ -0,0 +1,183 @@
+#if !defined(RUNTIME_FUNCTIONTABLE_H)
+#define RUNTIME_FUNCTIONTABLE_H
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FunctionHeader.h"
+
+struct Function;
+
+/**
+ * A set of functions, stored as one bit per function ID.  Inserting and
+ * removing never allocate, so sets can be updated in signal handlers, and
+ * iteration is a scan over contiguous words that skips empty ones.
+ */
+struct FunctionBits {
+public:
+    enum { End = (size_t)-1 };     //< Returned by next() when no member is left
+
+private:
+    std::vector<uint64_t> _words;
+
+public:
+    /**
+     * \brief Make room for function IDs below n.  Not safe in signal handlers.
+     */
+    inline void resize(size_t n) {
+        _words.resize((n + 63) / 64, 0);
+    }
+
+    inline void set(size_t i) {
+        _words[i / 64] |= 1ull << (i % 64);
+    }
+
+    inline void clear(size_t i) {
+        _words[i / 64] &= ~(1ull << (i % 64));
+    }
+
+    inline bool test(size_t i) {
+        return (_words[i / 64] >> (i % 64)) & 1;
+    }
+
+    inline void clear() {
+        for(size_t w=0; w<_words.size(); w++) {
+            _words[w] = 0;
+        }
+    }
+
+    inline bool empty() {
+        for(size_t w=0; w<_words.size(); w++) {
+            if(_words[w] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline size_t count() {
+        size_t n = 0;
+        for(size_t w=0; w<_words.size(); w++) {
+            n += __builtin_popcountll(_words[w]);
+        }
+        return n;
+    }
+
+    /**
+     * \brief Find the first member at or after an ID
+     * \arg i The ID to start from
+     * \returns The member's ID, or End
+     */
+    inline size_t next(size_t i) {
+        size_t w = i / 64;
+        if(w >= _words.size()) {
+            return End;
+        }
+
+        uint64_t bits = _words[w] & (~0ull << (i % 64));
+        while(bits == 0) {
+            if(++w == _words.size()) {
+                return End;
+            }
+            bits = _words[w];
+        }
+
+        return w * 64 + __builtin_ctzll(bits);
+    }
+};
+
+/**
+ * Every registered function, indexed by its ID (see Function::getId).  The
+ * per-function state that epoch boundaries scan is kept in parallel arrays:
+ * each function's header, the writable view traps are written through, its
+ * stack pad slot, and bits for the trapped, live, and hot sets.  Arming traps
+ * and walking the live set then read contiguous memory instead of a Function
+ * object per function.  Functions are only added before main runs.
+ */
+struct FunctionTable {
+private:
+    std::vector<Function*> _functions;
+    std::vector<FunctionHeader*> _headers;      //< Where each header executes
+    std::vector<FunctionHeader*> _headerViews;  //< Where each header is written
+    std::vector<uint8_t*> _pads;    //< Each function's slot in its module's stack pad table, or NULL
+    FunctionBits _trapped;  //< Functions whose header holds a trap rather than a jump
+    FunctionBits _live;     //< Functions running from a copy made this epoch
+    FunctionBits _hot;      //< Functions called in the previous epoch, which get spare copies
+
+public:
+    /**
+     * \brief Get the table of all registered functions
+     */
+    static inline FunctionTable& get() {
+        static FunctionTable _table;
+        return _table;
+    }
+
+    /**
+     * \brief Add a newly registered function
+     * \arg f The function
+     * \arg header The function's header, where it executes
+     * \arg headerView The writable view of the header
+     * \arg pad The function's stack pad slot, or NULL
+     * \returns The function's ID
+     */
+    inline size_t add(Function* f, FunctionHeader* header, FunctionHeader* headerView, uint8_t* pad) {
+        size_t id = _functions.size();
+        _functions.push_back(f);
+        _headers.push_back(header);
+        _headerViews.push_back(headerView);
+        _pads.push_back(pad);
+        _trapped.resize(id + 1);
+        _live.resize(id + 1);
+        _hot.resize(id + 1);
+        return id;
+    }
+
+    inline size_t size() {
+        return _functions.size();
+    }
+
+    inline Function* operator[](size_t id) {
+        return _functions[id];
+    }
+
+    inline FunctionHeader* getHeader(size_t id) {
+        return _headers[id];
+    }
+
+    inline FunctionHeader* getHeaderView(size_t id) {
+        return _headerViews[id];
+    }
+
+    inline uint8_t* getPad(size_t id) {
+        return _pads[id];
+    }
+
+    /**
+     * \brief Place a trap in a function's header.  All other threads must be
+     * stopped.
+     */
+    inline void setTrap(size_t id) {
+        _headerViews[id]->trap();
+        _trapped.set(id);
+    }
+
+    inline bool isTrapped(size_t id) {
+        return _trapped.test(id);
+    }
+
+    inline FunctionBits& trapped() {
+        return _trapped;
+    }
+
+    inline FunctionBits& live() {
+        return _live;
+    }
+
+    inline FunctionBits& hot() {
+        return _hot;
+    }
+};
+
+#endif
@@ -2,11 +2,14 @@
 #define RUNTIME_HEAP_H
 
 #include <heaplayers>
-#include <shuffleheap.h>
 
 #include "Util.h"
 #include "MMapSource.h"
+#include "ShuffleLayer.h"
+#include "Trace.h"
+#include "Stats.h"
 
+/// Shuffle depths are the most STABILIZER_SHUFFLE_DEPTH can select (see ShuffleLayer)
 enum {
     DataShuffle = 256,
     DataProt = PROT_READ | PROT_WRITE,
@@ -16,16 +19,29 @@ enum {
     CodeShuffle = 256,
     CodeProt = PROT_READ | PROT_WRITE | PROT_EXEC,
     CodeFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
-    CodeSize = 0x2000000
+    CodeRegionSize = 0x200000
 };
 
-class DataSource : public SizeHeap<FreelistHeap<BumpAlloc<DataSize, MMapSource<DataProt, DataFlags>, 16> > > {};
-class CodeSource : public SizeHeap<FreelistHeap<BumpAlloc<CodeSize, MMapSource<CodeProt, CodeFlags>, CODE_ALIGN> > > {};
+/**
+ * Logs each arena mapped for the data heap to the layout trace, and counts it
+ * in the runtime statistics.  Arenas are never unmapped.
+ */
+template<class SuperHeap> class ArenaTrace : public SuperHeap {
+public:
+    inline void* malloc(size_t sz) {
+        void* p = SuperHeap::malloc(sz);
+        if(p != NULL) {
+            Trace::arena(p, sz);
+            Stats::mapped(Stats::DataMemory, sz);
+        }
+        return p;
+    }
+};
+
+class DataSource : public SizeHeap<FreelistHeap<BumpAlloc<DataSize, ArenaTrace<MMapSource<DataProt, DataFlags> >, 16> > > {};
     
-typedef ANSIWrapper<KingsleyHeap<ShuffleHeap<DataShuffle, DataSource>, DataSource> > DataHeapType;
-typedef ANSIWrapper<KingsleyHeap<ShuffleHeap<CodeShuffle, CodeSource>, CodeSource> > CodeHeapType;
+typedef ANSIWrapper<KingsleyHeap<ShuffleLayer<Random::DataStream, DataShuffle, DataSource>, DataSource> > DataHeapType;
     
 DataHeapType* getDataHeap();
-CodeHeapType* getCodeHeap();
 
 #endif
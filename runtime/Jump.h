@@ -11,14 +11,38 @@ struct X86Jump32 {
     volatile uint8_t jmp_opcode;
     volatile uint32_t jmp_offset;
 
-    X86Jump32(void *target) {
+    /**
+     * \arg target The destination of the jump
+     * \arg pc The address the jump executes at.  Code may be written through a
+     * different view than the one it runs in (see DualMap).
+     */
+    X86Jump32(void *target, void* pc) {
         jmp_opcode = 0xE9;
-        jmp_offset = (uint32_t)((intptr_t)target - (intptr_t)this) - sizeof(struct X86Jump32);
+        jmp_offset = (uint32_t)((intptr_t)target - (intptr_t)pc) - sizeof(struct X86Jump32);
     }
+    
+    /**
+     * Place a jump at p with a single aligned 64 bit store, so a thread
+     * executing at pc sees either the old instructions or the complete jump.
+     * The three bytes that follow the jump are preserved.
+     */
+    static void placeAtomic(void* p, void* pc, void* target) {
+        uint32_t offset = (uint32_t)((intptr_t)target - (intptr_t)pc) - sizeof(struct X86Jump32);
+        uint64_t word = *(volatile uint64_t*)p;
+        
+        word &= ~0xFFFFFFFFFFull;
+        word |= 0xE9;
+        word |= (uint64_t)offset << 8;
+        
+        *(volatile uint64_t*)p = word;
+    }
+
 
 } __attribute__((packed));
 
 struct X86Jump64 {
+    enum { SubOpcode = 0x08EC8348 };
+    
     volatile uint32_t sub_8_rsp;
     volatile uint32_t mov_imm_0rsp;
     volatile uint32_t target_low;
@@ -32,7 +56,7 @@ struct X86Jump64 {
          *  2. Put the target address on the stack in 32 bit chunks
          *  3. Return
          */
-        sub_8_rsp = 0x08EC8348;     // move the stack pointer down 8 bytes
+        sub_8_rsp = SubOpcode;      // move the stack pointer down 8 bytes
         mov_imm_0rsp = 0x002444C7;  // move an immediate to 0(%rsp)
         target_low = (uint32_t)(int64_t)target;
         mov_imm_4rsp = 0x042444C7;  // move an immediate to 4(%rsp)
@@ -47,13 +71,22 @@ struct X86_64Jump {
         uint8_t jmp64[sizeof(X86Jump64)];
     };
     
-    X86_64Jump(void *target) {
-        if((uintptr_t)target - (uintptr_t)this <= 0x00000000FFFFFFFFu || (uintptr_t)this - (uintptr_t)target <= 0x00000000FFFFFFFFu) {
-            new(this) X86Jump32(target);
+    X86_64Jump(void *target, void* pc) {
+        if(isNear(pc, target)) {
+            new(this) X86Jump32(target, pc);
         } else {
             new(this) X86Jump64(target);
         }
     }
+    
+    /**
+     * Check if a jump placed at p can reach target with a 32 bit offset.  The
+     * offset is signed and relative to the end of the jump.
+     */
+    static bool isNear(void* p, void* target) {
+        intptr_t offset = (intptr_t)target - ((intptr_t)p + (intptr_t)sizeof(X86Jump32));
+        return offset == (intptr_t)(int32_t)offset;
+    }
 } __attribute__((packed));
 
 struct PPCJump {
@@ -67,10 +100,10 @@ struct PPCJump {
         };
     } __attribute__((packed));
 
-    PPCJump(void *target) {
+    PPCJump(void *target, void* pc) {
         uintptr_t t = (uintptr_t)target;
-        uintptr_t pos_offset = t - (uintptr_t)this;
-        intptr_t neg_offset = (intptr_t)this - (intptr_t)t;
+        uintptr_t pos_offset = t - (uintptr_t)pc;
+        intptr_t neg_offset = (intptr_t)pc - (intptr_t)t;
 
         /*if(t < 1<<25) {
             DEBUG("absolute jump");
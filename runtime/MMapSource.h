@@ -1,17 +1,99 @@
 #if !defined(RUNTIME_MMAPSOURCE_H)
 #define RUNTIME_MMAPSOURCE_H
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "Util.h"
+#include "Config.h"
+
+/**
+ * Process-wide setting for backing runtime heaps with huge pages
+ */
+struct HugePages {
+    enum { Size = 0x200000 };
+    
+    /**
+     * \brief Check if huge pages were requested with STABILIZER_HUGEPAGES.  The
+     * setting is read on first use, since the heaps are used by module
+     * constructors before main runs.
+     */
+    static inline bool enabled() {
+        static bool _enabled = Config::flag("STABILIZER_HUGEPAGES", false);
+        return _enabled;
+    }
+    
+    /**
+     * \brief Round a mapping size up to the page size in use
+     */
+    static inline size_t round(size_t sz) {
+        size_t page = enabled() ? Size : PAGESIZE;
+        return (sz + page - 1) & ~(page - 1);
+    }
+};
 
 template<int Prot, int Flags> class MMapSource {
 private:
     bool _exhausted32;
+    bool _noHugeTLB;    //< Set once MAP_HUGETLB fails, so later maps go straight to transparent huge pages
+    
+    /**
+     * Map memory with huge pages.  Reserved huge pages are used if the system
+     * has any, otherwise a huge page aligned region is mapped and marked for
+     * transparent huge pages.
+     */
+    inline void* mapHuge(size_t sz, int flags) {
+        void* ptr;
+        
+#if IS_LINUX
+        if(!_noHugeTLB) {
+            ptr = mmap(NULL, sz, Prot, flags | MAP_HUGETLB, -1, 0);
+            
+            if(ptr != MAP_FAILED) {
+                return ptr;
+            } else {
+                _noHugeTLB = true;
+            }
+        }
+#endif
+        
+        // Over-allocate so the mapping can be trimmed to a huge page boundary
+        ptr = mmap(NULL, sz + HugePages::Size, Prot, flags, -1, 0);
+        
+        if(ptr == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        
+        uintptr_t base = (uintptr_t)ptr;
+        uintptr_t aligned = (base + HugePages::Size - 1) & ~((uintptr_t)HugePages::Size - 1);
+        
+        if(aligned > base) {
+            munmap(ptr, aligned - base);
+        }
+        
+        munmap((void*)(aligned + sz), base + HugePages::Size - aligned);
+        
+#if IS_LINUX
+        madvise((void*)aligned, sz, MADV_HUGEPAGE);
+#endif
+        
+        return (void*)aligned;
+    }
+    
+    inline void* map(size_t sz, int flags) {
+        if(HugePages::enabled()) {
+            return mapHuge(HugePages::round(sz), flags);
+        } else {
+            return mmap(NULL, sz, Prot, flags, -1, 0);
+        }
+    }
     
 public:
     enum { Alignment = PAGESIZE };
 
     MMapSource() {
         _exhausted32 = false;
+        _noHugeTLB = false;
     }
     
     inline void* malloc(size_t sz) {
@@ -20,7 +102,7 @@ public:
         if(Flags & MAP_32BIT) {
             // If we haven't exhausted the 32 bit pages
             if(!_exhausted32) {
-                ptr = mmap(NULL, sz, Prot, Flags, -1, 0);
+                ptr = map(sz, Flags);
                 
                 if(ptr != MAP_FAILED) {
                     return ptr;
@@ -31,7 +113,7 @@ public:
         }
         
         // Try the map without the MAP_32BIT flag set
-        ptr = mmap(NULL, sz, Prot, Flags & ~MAP_32BIT, -1, 0);
+        ptr = map(sz, Flags & ~MAP_32BIT);
         
         if(ptr == MAP_FAILED) {
             ptr = NULL;
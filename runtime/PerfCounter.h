@@ -0,0 +1,216 @@
+#if !defined(RUNTIME_PERFCOUNTER_H)
+#define RUNTIME_PERFCOUNTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Arch.h"
+
+#if IS_LINUX
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * A hardware event counter for the calling thread and any threads it creates
+ * later.  Counters are unavailable on platforms without perf_event_open, or
+ * when the kernel or virtual machine does not expose the event.
+ */
+struct PerfCounter {
+public:
+    enum Event {
+        ITLBMisses,     //< Instruction TLB read misses
+        Instructions    //< Retired instructions
+    };
+    
+private:
+    int _fd;
+
+public:
+    /**
+     * \brief Open and start a counter
+     * \arg e The event to count
+     */
+    PerfCounter(Event e) : _fd(-1) {
+#if IS_LINUX
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.size = sizeof(pe);
+        
+        switch(e) {
+            case ITLBMisses:
+                pe.type = PERF_TYPE_HW_CACHE;
+                pe.config = PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case Instructions:
+                pe.type = PERF_TYPE_HARDWARE;
+                pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+        }
+        
+        pe.inherit = 1;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        
+        _fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+    }
+    
+    ~PerfCounter() {
+#if IS_LINUX
+        if(_fd != -1) {
+            close(_fd);
+        }
+#endif
+    }
+    
+    inline bool isAvailable() {
+        return _fd != -1;
+    }
+    
+    /**
+     * \brief Read the current count
+     * \returns The number of events counted so far, or zero if the counter is unavailable
+     */
+    inline uint64_t read() {
+        uint64_t count = 0;
+
+#if IS_LINUX
+        if(_fd != -1 && ::read(_fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+#endif
+
+        return count;
+    }
+};
+
+/**
+ * Counters that the kernel schedules onto the hardware together and reads in
+ * one call, so every count in a read covers the same stretch of execution.
+ * Unlike PerfCounter, a group counts only the thread that opened it: the
+ * kernel adds an inherited group's counts from other threads only when they
+ * exit, so reads would miss running threads.  Use openLike() to count the
+ * same events in another thread.  Events the kernel can't count are left out
+ * of the group.
+ */
+struct PerfCounterGroup {
+public:
+    enum { MaxEvents = 8 };
+    
+private:
+    int _fds[MaxEvents];
+    const char* _names[MaxEvents];
+    uint32_t _types[MaxEvents];
+    uint64_t _configs[MaxEvents];
+    size_t _count;
+    
+public:
+    PerfCounterGroup() : _count(0) {}
+    
+    ~PerfCounterGroup() {
+#if IS_LINUX
+        for(size_t i=0; i<_count; i++) {
+            close(_fds[i]);
+        }
+#endif
+    }
+    
+    /**
+     * \brief Add an event to the group.  The first event added leads the group.
+     * \arg type The perf_event_attr type, such as PERF_TYPE_HARDWARE
+     * \arg config The perf_event_attr config for the event
+     * \arg name The event's name for reports
+     * \returns True if the kernel can count the event
+     */
+    bool add(uint32_t type, uint64_t config, const char* name) {
+#if IS_LINUX
+        if(_count == MaxEvents) {
+            return false;
+        }
+        
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.size = sizeof(pe);
+        pe.type = type;
+        pe.config = config;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        
+        int fd = syscall(__NR_perf_event_open, &pe, 0, -1, _count > 0 ? _fds[0] : -1, 0);
+        if(fd == -1) {
+            return false;
+        }
+        
+        _fds[_count] = fd;
+        _names[_count] = name;
+        _types[_count] = type;
+        _configs[_count] = config;
+        _count++;
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    /**
+     * \brief Count the same events as another group, in the calling thread
+     * \arg model The group to copy
+     * \returns True if every event in model could be counted.  Otherwise the
+     * group is left empty, so its counts never line up with the wrong events.
+     */
+    bool openLike(PerfCounterGroup* model) {
+        for(size_t i=0; i<model->_count; i++) {
+            if(!add(model->_types[i], model->_configs[i], model->_names[i])) {
+#if IS_LINUX
+                for(size_t j=0; j<_count; j++) {
+                    close(_fds[j]);
+                }
+#endif
+                _count = 0;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    inline size_t size() {
+        return _count;
+    }
+    
+    inline const char* getName(size_t i) {
+        return _names[i];
+    }
+    
+    /**
+     * \brief Read every counter in the group.  When the kernel had to share
+     * the hardware with other groups, counts are scaled up to the full time
+     * the group was enabled.
+     * \arg values Receives one count per event, in the order events were added
+     * \returns True if the counts were read
+     */
+    bool read(uint64_t* values) {
+#if IS_LINUX
+        uint64_t buf[3 + MaxEvents];
+        size_t sz = (3 + _count) * sizeof(uint64_t);
+        
+        if(_count == 0 || ::read(_fds[0], buf, sz) != (ssize_t)sz) {
+            return false;
+        }
+        
+        // The read gives the number of events, the times enabled and running, then the counts
+        double scale = buf[2] > 0 ? (double)buf[1] / buf[2] : 0;
+        for(size_t i=0; i<_count; i++) {
+            values[i] = (uint64_t)(buf[3 + i] * scale);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+#endif
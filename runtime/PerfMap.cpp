@@ -0,0 +1,137 @@
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfMap.h"
+#include "Config.h"
+
+char PerfMap::_buffer[BufferSize];
+size_t PerfMap::_used = 0;
+int PerfMap::_fd = -1;
+int PerfMap::_pid = 0;
+size_t PerfMap::_reserved = 0;
+bool PerfMap::_reused = false;
+
+bool PerfMap::enabled() {
+    static bool _enabled = Config::flag("STABILIZER_PERFMAP", false);
+    return _enabled;
+}
+
+const char* PerfMap::resolve(void* code) {
+    Dl_info info;
+    if(!dladdr(code, &info)) {
+        return "[stabilizer]";
+    }
+
+    if(info.dli_sname != NULL && info.dli_saddr == code) {
+        return info.dli_sname;
+    }
+
+    // Name local functions by their offset in the module, for addr2line
+    const char* module = info.dli_fname != NULL ? info.dli_fname : "";
+    if(strrchr(module, '/') != NULL) {
+        module = strrchr(module, '/') + 1;
+    }
+
+    char name[256];
+    snprintf(name, sizeof(name), "%s+0x%lx", module, (unsigned long)((uintptr_t)code - (uintptr_t)info.dli_fbase));
+    return strdup(name);
+}
+
+void PerfMap::add(void* base, size_t sz, const char* name) {
+    char line[320];
+    int n = snprintf(line, sizeof(line), "%lx %lx %s\n", (unsigned long)base, (unsigned long)sz, name);
+
+    if(n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    if(_used + n > BufferSize) {
+        flush();
+    }
+
+    memcpy(&_buffer[_used], line, n);
+    _used += n;
+}
+
+/**
+ * Open a process's map file
+ * \returns The file descriptor, or -1 on failure
+ */
+int PerfMap::openMap(int pid, int flags) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", pid);
+    return open(path, flags, 0644);
+}
+
+bool PerfMap::reserve(size_t sz) {
+    if(!enabled()) {
+        return false;
+    }
+
+    if(_reserved + sz > ReserveLimit) {
+        _reused = true;
+        return false;
+    }
+
+    _reserved += sz;
+    return true;
+}
+
+void PerfMap::flush() {
+    if(_used == 0) {
+        return;
+    }
+
+    if(_fd == -1) {
+        _pid = getpid();
+        _fd = openMap(_pid, O_WRONLY | O_CREAT | O_APPEND);
+    }
+
+    if(_fd != -1 && write(_fd, _buffer, _used) != (ssize_t)_used) {
+        // perf will show the missing copies as unknown code
+    }
+
+    _used = 0;
+}
+
+void PerfMap::finish() {
+    flush();
+
+    if(_reused) {
+        fprintf(stderr, "stabilizer: reserved %luMB of freed code for the perf map, then reused addresses; "
+            "later samples may be named after code that was there earlier\n", (unsigned long)(_reserved >> 20));
+    }
+}
+
+void PerfMap::afterForkChild() {
+    // Until the parent writes its map, buffered lines go to the child's map on the first flush
+    if(_fd == -1) {
+        return;
+    }
+
+    close(_fd);
+    int parent = openMap(_pid, O_RDONLY);
+    _pid = getpid();
+    _fd = openMap(_pid, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+
+    if(parent == -1) {
+        return;
+    }
+
+    // The child has the parent's code, so it needs the parent's names for it
+    char buf[4096];
+    ssize_t n;
+    while(_fd != -1 && (n = read(parent, buf, sizeof(buf))) > 0) {
+        if(write(_fd, buf, n) != n) {
+            break;
+        }
+    }
+
+    close(parent);
+}
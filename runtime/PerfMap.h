@@ -0,0 +1,92 @@
+#if !defined(RUNTIME_PERFMAP_H)
+#define RUNTIME_PERFMAP_H
+
+#include <stddef.h>
+
+/**
+ * Writes /tmp/perf-<pid>.map, which Linux perf reads to name samples in code
+ * it can't find in any loaded file.  Each function copy gets a line mapping
+ * its address range to the original function's name, so profiles of a
+ * randomized run are attributed to the right functions.
+ *
+ * Lines are collected in a buffer and written at epoch boundaries, when the
+ * buffer fills, and at exit, so relocation never waits on the file.  Enabled
+ * by setting STABILIZER_PERFMAP=1.
+ * 
+ * The map can't remove entries, so while it is enabled, code regions that are
+ * freed keep their addresses reserved and no two copies share an address.
+ * Code is placed in the 1GB that MAP_32BIT allocates from, so reservations
+ * stop at ReserveLimit.  Later addresses may be reused, and a note is printed
+ * at exit.  Dual mapped program text is listed too, since perf sees it as
+ * memfd memory.
+ *
+ * A forked child writes its own map, which starts with the parent's lines.
+ */
+struct PerfMap {
+private:
+    enum {
+        BufferSize = 0x10000,
+        ReserveLimit = 0x10000000   //< Most freed code kept reserved, a quarter of the MAP_32BIT range
+    };
+
+    static char _buffer[BufferSize];
+    static size_t _used;
+    static int _fd;
+    static int _pid;            //< The process the open map file belongs to
+    static size_t _reserved;    //< Bytes of freed code kept reserved
+    static bool _reused;        //< Set once freed code is unmapped for lack of room
+
+    static int openMap(int pid, int flags);
+
+public:
+    /**
+     * \brief Check if the map was requested.  The setting is read on first
+     * use, since functions are registered by module constructors before main.
+     */
+    static bool enabled();
+
+    /**
+     * \brief Look up the name perf should show for a function.  Functions
+     * without a dynamic symbol are named by module and offset.
+     * \arg code The function's original address
+     * \returns A name that lives as long as the process
+     */
+    static const char* resolve(void* code);
+
+    /**
+     * \brief Add a function copy to the map.  Must be called with the
+     * runtime lock held.
+     * \arg base The base of the copy
+     * \arg sz The size of the copy
+     * \arg name The function's name from resolve()
+     */
+    static void add(void* base, size_t sz, const char* name);
+
+    /**
+     * \brief Check if freed code should keep its addresses reserved, and
+     * count it if so.  Must be called with the runtime lock held.
+     * \arg sz The size of the freed code
+     * \returns False if the map is disabled or the reservations are full
+     */
+    static bool reserve(size_t sz);
+
+    /**
+     * \brief Write buffered lines to the map file.  Safe to call from
+     * signal handlers.
+     */
+    static void flush();
+
+    /**
+     * \brief Write the remaining lines at exit, and note if addresses in the
+     * map were reused
+     */
+    static void finish();
+
+    /**
+     * \brief Start a forked child's map with a copy of the parent's.
+     * Installed with pthread_atfork, and runs while the runtime lock is held.
+     */
+    static void afterForkChild();
+};
+
+#endif
@@ -0,0 +1,207 @@
+#if !defined(RUNTIME_POOL_H)
+#define RUNTIME_POOL_H
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "Util.h"
+#include "Debug.h"
+
+/**
+ * A lock-free pool of fixed-size slots for runtime metadata, safe to use from
+ * signal handlers.  Slots come from slabs mapped with mmap and are never
+ * returned to the system.  Pools are sized with reserve() at startup; if a
+ * pool runs dry it maps another slab rather than calling malloc.
+ *
+ * Free slots form a stack whose head packs a pointer with a tag that changes
+ * on every update, so a pop can't be fooled by a slot that was popped and
+ * pushed back in between (the ABA problem).
+ *
+ * \tparam Size The slot size in bytes
+ */
+template<size_t Size> class Pool {
+private:
+    union Slot {
+        Slot* next;
+        uint8_t data[Size];
+        uint64_t align;
+    };
+
+    static volatile uint64_t _head;
+    static volatile size_t _capacity;
+
+    static inline uint64_t pack(Slot* s, uint64_t tag) {
+        if(sizeof(void*) == 8) {
+            return ((uint64_t)(uintptr_t)s & 0xFFFFFFFFFFFFull) | (tag << 48);
+        } else {
+            return (uint64_t)(uintptr_t)s | (tag << 32);
+        }
+    }
+
+    static inline Slot* slotOf(uint64_t head) {
+        if(sizeof(void*) == 8) {
+            return (Slot*)(uintptr_t)(head & 0xFFFFFFFFFFFFull);
+        } else {
+            return (Slot*)(uintptr_t)(uint32_t)head;
+        }
+    }
+
+    static inline uint64_t tagOf(uint64_t head) {
+        return sizeof(void*) == 8 ? head >> 48 : head >> 32;
+    }
+
+    static void push(Slot* s) {
+        uint64_t head;
+        do {
+            head = _head;
+            s->next = slotOf(head);
+        } while(!__sync_bool_compare_and_swap(&_head, head, pack(s, tagOf(head) + 1)));
+    }
+
+    /**
+     * Map a slab with room for at least n slots and add them to the pool
+     */
+    static bool grow(size_t n) {
+        size_t bytes = n * sizeof(Slot);
+        bytes = (bytes + PAGESIZE - 1) & ~((size_t)PAGESIZE - 1);
+
+        void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+            return false;
+        }
+
+        Slot* slots = (Slot*)p;
+        n = bytes / sizeof(Slot);
+
+        for(size_t i=0; i<n; i++) {
+            push(&slots[i]);
+        }
+
+        __sync_fetch_and_add(&_capacity, n);
+        return true;
+    }
+
+public:
+    /**
+     * \brief Make sure the pool has at least n slots in total
+     */
+    static void reserve(size_t n) {
+        if(n > _capacity) {
+            grow(n - _capacity);
+        }
+    }
+
+    static inline size_t capacity() {
+        return _capacity;
+    }
+
+    static void* allocate() {
+        uint64_t head;
+        Slot* s;
+
+        do {
+            head = _head;
+            s = slotOf(head);
+
+            if(s == NULL) {
+                // Map a slab as large as the pool so far, so growth stays rare
+                if(!grow(_capacity > 0 ? _capacity : PAGESIZE / sizeof(Slot))) {
+                    return NULL;
+                }
+                head = _head;
+                s = slotOf(head);
+            }
+        } while(s == NULL || !__sync_bool_compare_and_swap(&_head, head, pack(s->next, tagOf(head) + 1)));
+
+        return s;
+    }
+
+    static void free(void* p) {
+        if(p != NULL) {
+            push((Slot*)p);
+        }
+    }
+};
+
+template<size_t Size> volatile uint64_t Pool<Size>::_head = 0;
+template<size_t Size> volatile size_t Pool<Size>::_capacity = 0;
+
+/**
+ * An STL allocator for node-based containers (set, map, list) that takes
+ * nodes from a shared pool, so containers can be updated in signal handlers.
+ * Every node must fit in NodeSize bytes.
+ */
+template<class T> class PoolAllocator {
+public:
+    enum { NodeSize = 64 };
+
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template<class U> struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    PoolAllocator() {}
+    template<class U> PoolAllocator(const PoolAllocator<U>&) {}
+
+    /**
+     * \brief Reserve nodes for n container elements
+     */
+    static void reserve(size_t n) {
+        Pool<NodeSize>::reserve(n);
+    }
+
+    pointer allocate(size_type n, const void* = 0) {
+        if(n * sizeof(T) > NodeSize) {
+            ABORT("Pool allocation of %lu bytes is larger than a node", (unsigned long)(n * sizeof(T)));
+        }
+
+        pointer p = (pointer)Pool<NodeSize>::allocate();
+        if(p == NULL) {
+            ABORT("Out of memory for runtime metadata");
+        }
+        return p;
+    }
+
+    void deallocate(pointer p, size_type n) {
+        Pool<NodeSize>::free(p);
+    }
+
+    size_type max_size() const {
+        return NodeSize / sizeof(T);
+    }
+
+    void construct(pointer p, const T& v) {
+        new(p) T(v);
+    }
+
+    void destroy(pointer p) {
+        p->~T();
+    }
+
+    pointer address(reference r) const {
+        return &r;
+    }
+
+    const_pointer address(const_reference r) const {
+        return &r;
+    }
+
+    template<class U> bool operator==(const PoolAllocator<U>&) const {
+        return true;
+    }
+
+    template<class U> bool operator!=(const PoolAllocator<U>&) const {
+        return false;
+    }
+};
+
+#endif
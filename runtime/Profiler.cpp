@@ -0,0 +1,174 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "Profiler.h"
+#include "Debug.h"
+
+using namespace std;
+
+Profiler::Slot* Profiler::_table = NULL;
+uint32_t Profiler::_epoch = 0;
+uint64_t Profiler::_samples = 0;
+uint64_t Profiler::_busy = 0;
+uint64_t Profiler::_overflow = 0;
+
+void Profiler::start() {
+    void* p = mmap(NULL, TableSize * sizeof(Slot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        ABORT("Couldn't map the profile");
+    }
+    _table = (Slot*)p;
+
+    struct itimerval timer;
+    timer.it_value.tv_sec = 0;
+    timer.it_value.tv_usec = Interval;
+    timer.it_interval = timer.it_value;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void Profiler::stop() {
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void Profiler::epoch() {
+    _epoch++;
+}
+
+void Profiler::busy() {
+    __sync_fetch_and_add(&_busy, 1);
+}
+
+/**
+ * Add one to a counter, claiming a slot for it on first use.  Counters that
+ * don't fit are tallied as overflow, so the report shows what was lost.
+ */
+void Profiler::count(Kind k, uint32_t epoch, uintptr_t a, uintptr_t b) {
+    uint64_t key = (uint64_t)k << 32 | epoch;
+
+    uint64_t h = (key * 0x9E3779B97F4A7C15ull) ^ (a * 0xBF58476D1CE4E5B9ull) ^ (b * 0x94D049BB133111EBull);
+    h ^= h >> 29;
+
+    for(size_t i=0; i<MaxProbes; i++) {
+        Slot& s = _table[(h + i) % TableSize];
+
+        if(s.key == 0) {
+            s.key = key;
+            s.a = a;
+            s.b = b;
+        }
+
+        if(s.key == key && s.a == a && s.b == b) {
+            s.count++;
+            return;
+        }
+    }
+
+    _overflow++;
+}
+
+void Profiler::record(void** chain, size_t depth) {
+    _samples++;
+
+    count(Self, _epoch, (uintptr_t)chain[0], 0);
+
+    for(size_t i=0; i<depth; i++) {
+        // Recursive functions are only counted once per sample
+        bool seen = false;
+        for(size_t j=0; j<i && !seen; j++) {
+            seen = chain[j] == chain[i];
+        }
+
+        if(!seen) {
+            count(Total, 0, (uintptr_t)chain[i], 0);
+        }
+
+        if(i + 1 < depth) {
+            count(Edge, 0, (uintptr_t)chain[i + 1], (uintptr_t)chain[i]);
+        }
+    }
+}
+
+typedef pair<uint64_t, string> Ranked;
+
+/**
+ * Sort counters from most to least samples
+ */
+static vector<Ranked> byCount(map<string, uint64_t>& counts) {
+    vector<Ranked> r;
+    for(map<string, uint64_t>::iterator iter = counts.begin(); iter != counts.end(); iter++) {
+        r.push_back(Ranked(iter->second, iter->first));
+    }
+    sort(r.rbegin(), r.rend());
+    return r;
+}
+
+void Profiler::report(FILE* f, Namer name) {
+    map<string, uint64_t> self;
+    map<string, uint64_t> total;
+    map<string, uint64_t> edges;
+    map<uint32_t, map<string, uint64_t> > epochs;
+
+    // Several addresses can have the same name, so counts are merged by name
+    for(size_t i=0; _table != NULL && i<TableSize; i++) {
+        Slot& s = _table[i];
+        if(s.key == 0) {
+            continue;
+        }
+
+        Kind k = (Kind)(s.key >> 32);
+        uint32_t epoch = (uint32_t)s.key;
+
+        if(k == Self) {
+            self[name((void*)s.a)] += s.count;
+            epochs[epoch][name((void*)s.a)] += s.count;
+        } else if(k == Total) {
+            total[name((void*)s.a)] += s.count;
+        } else if(k == Edge) {
+            edges[string(name((void*)s.a)) + " -> " + name((void*)s.b)] += s.count;
+        }
+    }
+
+    double percent = _samples > 0 ? 100.0 / _samples : 0;
+
+    fprintf(f, "stabilizer profile: %llu samples every %d us over %u epochs\n",
+        (unsigned long long)_samples, Interval, _epoch + 1);
+    fprintf(f, "%llu samples were dropped while the runtime was busy, %llu counts did not fit\n",
+        (unsigned long long)_busy, (unsigned long long)_overflow);
+
+    fprintf(f, "\nflat profile\n%7s %9s %7s %9s  %s\n", "self%", "self", "total%", "total", "function");
+    vector<Ranked> r = byCount(total);
+    for(size_t i=0; i<r.size(); i++) {
+        uint64_t s = self[r[i].second];
+        fprintf(f, "%6.2f%% %9llu %6.2f%% %9llu  %s\n", s * percent, (unsigned long long)s,
+            r[i].first * percent, (unsigned long long)r[i].first, r[i].second.c_str());
+    }
+
+    fprintf(f, "\ncall graph\n%9s  %s\n", "samples", "caller -> callee");
+    r = byCount(edges);
+    for(size_t i=0; i<r.size(); i++) {
+        fprintf(f, "%9llu  %s\n", (unsigned long long)r[i].first, r[i].second.c_str());
+    }
+
+    // Each epoch lists its hottest functions by self samples
+    fprintf(f, "\nepochs\n%5s %9s  %s\n", "epoch", "samples", "hottest functions");
+    for(map<uint32_t, map<string, uint64_t> >::iterator iter = epochs.begin(); iter != epochs.end(); iter++) {
+        r = byCount(iter->second);
+
+        uint64_t n = 0;
+        for(size_t i=0; i<r.size(); i++) {
+            n += r[i].first;
+        }
+
+        fprintf(f, "%5u %9llu ", iter->first, (unsigned long long)n);
+        for(size_t i=0; i<r.size() && i<5; i++) {
+            fprintf(f, " %s %.1f%%", r[i].second.c_str(), 100.0 * r[i].first / n);
+        }
+        fprintf(f, "\n");
+    }
+}
@@ -0,0 +1,93 @@
+#if !defined(RUNTIME_PROFILER_H)
+#define RUNTIME_PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A sampling profiler driven by SIGPROF.  Each sample is a call chain of
+ * functions, leaf first, with relocated addresses already folded back to the
+ * original functions, so every copy of a function counts as that function.
+ *
+ * Samples are counted in a preallocated hash table, so recording a sample
+ * never allocates.  At exit the table is written as a flat profile, a call
+ * graph, and a breakdown of the flat profile by epoch.
+ */
+struct Profiler {
+public:
+    enum {
+        Interval = 1000,    //< Microseconds of process CPU time between samples
+        MaxDepth = 64       //< The deepest call chain recorded
+    };
+
+    /// Names a function for the report, given its original address
+    typedef const char* (*Namer)(void* f);
+
+private:
+    enum Kind {
+        Self = 1,   //< a: function, per epoch
+        Total,      //< a: function anywhere on the stack
+        Edge        //< a: caller, b: callee
+    };
+
+    struct Slot {
+        uint64_t key;   //< Kind and epoch, or zero for an empty slot
+        uintptr_t a;
+        uintptr_t b;
+        uint64_t count;
+    };
+
+    enum {
+        TableSize = 1 << 18,    //< Slots in the table, 8MB mapped on demand
+        MaxProbes = 64
+    };
+
+    static Slot* _table;
+    static uint32_t _epoch;
+    static uint64_t _samples;
+    static uint64_t _busy;
+    static uint64_t _overflow;
+
+    static void count(Kind k, uint32_t epoch, uintptr_t a, uintptr_t b);
+
+public:
+    /**
+     * \brief Map the sample table and start the profiling timer.  SIGPROF
+     * must already be handled.
+     */
+    static void start();
+
+    /**
+     * \brief Stop the profiling timer
+     */
+    static void stop();
+
+    /**
+     * \brief Start counting samples for a new epoch.  Must be called with the
+     * runtime lock held.
+     */
+    static void epoch();
+
+    /**
+     * \brief Count a sample.  Must be called with the runtime lock held.
+     * \arg chain The original addresses of the functions on the stack, leaf first
+     * \arg depth The number of functions in the chain
+     */
+    static void record(void** chain, size_t depth);
+
+    /**
+     * \brief Count a sample that was dropped because the runtime lock was
+     * held.  Safe to call from signal handlers.
+     */
+    static void busy();
+
+    /**
+     * \brief Write the profile
+     * \arg f The output file
+     * \arg name Names functions by their original address
+     */
+    static void report(FILE* f, Namer name);
+};
+
+#endif
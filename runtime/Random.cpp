@@ -0,0 +1,77 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Random.h"
+#include "Util.h"
+
+uint64_t Random::_seed = 0;
+bool Random::_seeded = false;
+Random Random::_streams[StreamCount];
+
+/**
+ * Lanes filled at once.  Each lane hashes its own counter, so the loop body
+ * has no dependence between lanes and can be vectorized.
+ */
+enum { FillLanes = 8 };
+
+void Random::fill(void* p, size_t n) {
+    uint8_t* b = (uint8_t*)p;
+    uint64_t block[FillLanes];
+
+    while(n >= sizeof(block)) {
+        for(size_t i=0; i<FillLanes; i++) {
+            block[i] = mix(_counter + (i + 1) * Gamma);
+        }
+        _counter += FillLanes * Gamma;
+
+        memcpy(b, block, sizeof(block));
+        b += sizeof(block);
+        n -= sizeof(block);
+    }
+
+    while(n > 0) {
+        uint64_t r = next();
+        size_t k = n < sizeof(r) ? n : sizeof(r);
+        memcpy(b, &r, k);
+        b += k;
+        n -= k;
+    }
+}
+
+void Random::seed(uint64_t s) {
+    _seed = s;
+    _seeded = true;
+
+    for(size_t i=0; i<StreamCount; i++) {
+        _streams[i].reset(s, i);
+    }
+}
+
+uint64_t Random::getSeed() {
+    if(!_seeded) {
+        seed(entropy());
+    }
+    return _seed;
+}
+
+/**
+ * Read a seed from /dev/urandom, or fall back to the time and process ID
+ */
+uint64_t Random::entropy() {
+    uint64_t s = 0;
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd != -1) {
+        if(read(fd, &s, sizeof(s)) != sizeof(s)) {
+            s = 0;
+        }
+        close(fd);
+    }
+
+    if(s == 0) {
+        s = mix(getTime()) ^ getpid();
+    }
+
+    return s;
+}
@@ -0,0 +1,115 @@
+#if !defined(RUNTIME_RANDOM_H)
+#define RUNTIME_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The runtime's random number generator.  Values are SplitMix64 hashes of a
+ * counter, so a generator is a single word of state, can be seeded with any
+ * value, and can fill a buffer with independent lanes that the compiler
+ * vectorizes.
+ *
+ * Each kind of randomization draws from its own stream, so for example the
+ * program's heap allocations don't change which code placements are drawn.
+ * Every stream is derived from one seed (see Random::seed).  Generators are
+ * not thread-safe; callers hold the runtime lock.
+ */
+struct Random {
+public:
+    enum Stream {
+        CodeStream,     //< Placement of function copies
+        DataStream,     //< Placement of heap objects
+        PadStream,      //< Stack pad sizes
+        StreamCount
+    };
+
+private:
+    uint64_t _counter;
+    uint64_t _bytes;        //< Unused bytes of the last value, for nextByte()
+    size_t _byteCount;      //< The number of bytes left in _bytes
+
+    static uint64_t _seed;
+    static bool _seeded;
+    static Random _streams[StreamCount];
+
+    static const uint64_t Gamma = 0x9E3779B97F4A7C15ull;
+
+    static inline uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t entropy();
+
+    void reset(uint64_t seed, uint64_t stream) {
+        _counter = mix(seed + mix(stream + 1));
+        _bytes = 0;
+        _byteCount = 0;
+    }
+
+public:
+    /**
+     * \brief Get the next 64 random bits
+     */
+    inline uint64_t next() {
+        _counter += Gamma;
+        return mix(_counter);
+    }
+
+    /**
+     * \brief Get one random byte.  Eight bytes are drawn per value.
+     */
+    inline uint8_t nextByte() {
+        if(_byteCount == 0) {
+            _bytes = next();
+            _byteCount = sizeof(uint64_t);
+        }
+
+        uint8_t r = (uint8_t)_bytes;
+        _bytes >>= 8;
+        _byteCount--;
+        return r;
+    }
+
+    /**
+     * \brief Get a random index in [0, n), for n below 2^32.  Scales the high
+     * bits of a value instead of dividing.
+     */
+    inline size_t nextIndex(size_t n) {
+        return (size_t)(((next() >> 32) * (uint64_t)n) >> 32);
+    }
+
+    /**
+     * \brief Fill memory with random bytes.  Advances the stream as far as
+     * drawing one value per eight bytes would.
+     * \arg p The start of the memory
+     * \arg n The number of bytes to fill
+     */
+    void fill(void* p, size_t n);
+
+    /**
+     * \brief Seed every stream.  Streams are seeded from the kernel's entropy
+     * source on first use if this is never called.
+     * \arg s The seed
+     */
+    static void seed(uint64_t s);
+
+    /**
+     * \brief Get the seed the streams were derived from
+     */
+    static uint64_t getSeed();
+
+    /**
+     * \brief Get the generator for one kind of randomization
+     */
+    static inline Random& get(Stream s) {
+        if(!_seeded) {
+            seed(entropy());
+        }
+        return _streams[s];
+    }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#if !defined(RUNTIME_SHUFFLELAYER_H)
+#define RUNTIME_SHUFFLELAYER_H
+
+#include <stddef.h>
+
+#include "Random.h"
+#include "Config.h"
+
+/**
+ * Randomizes the placement of objects from a source heap that serves a
+ * single size class.  The layer keeps up to N objects ready.  Each allocation
+ * hands out a random ready object and replaces it with a new one from the
+ * source.  Each free puts the object in a random slot and returns the
+ * object it displaces to the source.
+ *
+ * The ready set grows by one object per allocation until it holds N, so a
+ * size class that is rarely used does not hold N objects.
+ *
+ * STABILIZER_SHUFFLE_DEPTH lowers the number of ready objects below N, and
+ * STABILIZER_HEAP=0 turns off shuffling of the program's heap.
+ *
+ * \tparam S The random stream that decides placements
+ * \tparam N The most ready objects allowed
+ * \tparam SuperHeap The source heap
+ */
+template<Random::Stream S, int N, class SuperHeap>
+class ShuffleLayer : public SuperHeap {
+private:
+    void* _objects[N];
+    size_t _count;
+
+    /**
+     * Read the number of ready objects from the settings.  Zero passes
+     * allocations straight through to the source.
+     */
+    static size_t readDepth() {
+        if(S == Random::DataStream && !Config::flag("STABILIZER_HEAP", true)) {
+            return 0;
+        }
+
+        size_t depth = Config::number("STABILIZER_SHUFFLE_DEPTH", N);
+        return depth < N ? depth : N;
+    }
+
+    static inline size_t getDepth() {
+        static size_t _depth = readDepth();
+        return _depth;
+    }
+
+public:
+    /**
+     * Read the depth when the heap is built, not on its first allocation,
+     * which may come from a signal handler
+     */
+    ShuffleLayer() : _count(0) {
+        getDepth();
+    }
+
+    void* malloc(size_t sz) {
+        size_t depth = getDepth();
+        if(depth == 0) {
+            return SuperHeap::malloc(sz);
+        }
+
+        if(_count < depth) {
+            void* p = SuperHeap::malloc(sz);
+            if(p == NULL) {
+                return NULL;
+            }
+            _objects[_count++] = p;
+        }
+
+        void* q = SuperHeap::malloc(sz);
+        if(q == NULL) {
+            return NULL;
+        }
+
+        size_t i = Random::get(S).nextIndex(_count);
+        void* p = _objects[i];
+        _objects[i] = q;
+        return p;
+    }
+
+    void free(void* p) {
+        size_t depth = getDepth();
+        if(depth == 0) {
+            SuperHeap::free(p);
+            return;
+        }
+
+        if(_count < depth) {
+            _objects[_count++] = p;
+            return;
+        }
+
+        size_t i = Random::get(S).nextIndex(depth);
+        void* q = _objects[i];
+        _objects[i] = p;
+        SuperHeap::free(q);
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Stats.h"
+#include "Config.h"
+#include "Util.h"
+
+Stats::Counter Stats::_events[EventCount];
+Stats::Usage Stats::_memory[MemoryCount];
+
+/// The clocks at load time, so readers can convert ticks to time
+static uint64_t start_ticks = Stats::now();
+static uint64_t start_time = getTime();
+
+static const char* event_names[Stats::EventCount] = {
+    "trap", "tick", "safepoint", "epoch_end", "relocate", "copy", "stack_walk", "sweep"
+};
+
+static const char* memory_names[Stats::MemoryCount] = {
+    "code", "data"
+};
+
+void Stats::mapped(Memory m, int64_t delta) {
+    int64_t current = __sync_add_and_fetch(&_memory[m].current, delta);
+
+    int64_t peak = _memory[m].peak;
+    while(current > peak && !__sync_bool_compare_and_swap(&_memory[m].peak, peak, current)) {
+        peak = _memory[m].peak;
+    }
+}
+
+/**
+ * Get the report file's name.  Read once, when main checks enabled(), so
+ * reports from signal handlers don't look up settings.
+ */
+static const char* getPath() {
+    static const char* _path = Config::get("STABILIZER_STATS");
+    return _path;
+}
+
+bool Stats::enabled() {
+    return getPath() != NULL;
+}
+
+/**
+ * Format the totals into a buffer and replace the file's contents.  Uses only
+ * snprintf and system calls, so a report can be taken from a signal handler.
+ */
+void Stats::report() {
+    if(!enabled()) {
+        return;
+    }
+
+    char buf[2048];
+    size_t n = 0;
+
+    n += snprintf(&buf[n], sizeof(buf) - n, "{\n  \"clock\": \"%s\",\n  \"elapsed_us\": %llu,\n  \"elapsed_ticks\": %llu,\n  \"events\": {\n",
+        IS_X86 || IS_X86_64 ? "tsc" : "ns",
+        (unsigned long long)(getTime() - start_time), (unsigned long long)(now() - start_ticks));
+
+    for(size_t i=0; i<EventCount && n < sizeof(buf); i++) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "    \"%s\": { \"count\": %llu, \"ticks\": %llu }%s\n",
+            event_names[i], (unsigned long long)_events[i].count, (unsigned long long)_events[i].ticks,
+            i + 1 < EventCount ? "," : "");
+    }
+
+    if(n < sizeof(buf)) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "  },\n  \"memory\": {\n");
+    }
+
+    for(size_t i=0; i<MemoryCount && n < sizeof(buf); i++) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "    \"%s\": { \"current\": %lld, \"peak\": %lld }%s\n",
+            memory_names[i], (long long)_memory[i].current, (long long)_memory[i].peak,
+            i + 1 < MemoryCount ? "," : "");
+    }
+
+    if(n < sizeof(buf)) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "  }\n}\n");
+    }
+
+    if(n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+
+    int fd = open(getPath(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        perror("open");
+        return;
+    }
+
+    if(write(fd, buf, n) != (ssize_t)n) {
+        perror("write");
+    }
+    close(fd);
+}
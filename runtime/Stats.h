@@ -0,0 +1,99 @@
+#if !defined(RUNTIME_STATS_H)
+#define RUNTIME_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "Arch.h"
+
+/**
+ * Counts of runtime events and the time spent in them, so the runtime's share
+ * of a stabilized run can be subtracted from measurements.  Time is measured
+ * in timestamp counter ticks on x86 and nanoseconds elsewhere.  Events nest:
+ * a trap's time includes the relocation it triggers, which includes the copy.
+ *
+ * The totals are written as JSON to the file named by STABILIZER_STATS at
+ * exit, and whenever the process receives SIGUSR2.
+ */
+struct Stats {
+public:
+    enum Event {
+        Trap,           //< Handling a trap, from the trap to the jump into the new copy
+        Tick,           //< Handling the re-randomization timer signal
+        Safepoint,      //< Handling a compiler-inserted poll that found the epoch over
+        EpochEnd,       //< Ending an epoch, from a timer tick or a trap
+        Relocate,       //< Moving a function to a new copy
+        Copy,           //< Copying a function's code
+        StackWalk,      //< Marking the function copies referenced by one stack
+        Sweep,          //< Collecting function copies that are no longer referenced
+        EventCount
+    };
+
+    enum Memory {
+        CodeMemory,     //< Mapped code regions
+        DataMemory,     //< Mapped data heap arenas
+        MemoryCount
+    };
+
+private:
+    struct Counter {
+        uint64_t count;
+        uint64_t ticks;
+    };
+
+    struct Usage {
+        int64_t current;
+        int64_t peak;
+    };
+
+    static Counter _events[EventCount];
+    static Usage _memory[MemoryCount];
+
+public:
+    /**
+     * \brief Read the clock that event times are measured with
+     */
+    static inline uint64_t now() {
+#if IS_X86 || IS_X86_64
+        uint32_t lo, hi;
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return (uint64_t)hi << 32 | lo;
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    /**
+     * \brief Count an event.  Safe to call from any thread or signal handler.
+     * \arg e The event
+     * \arg start The value of now() when the event started
+     */
+    static inline void add(Event e, uint64_t start) {
+        uint64_t elapsed = now() - start;
+        __sync_fetch_and_add(&_events[e].count, 1);
+        __sync_fetch_and_add(&_events[e].ticks, elapsed);
+    }
+
+    /**
+     * \brief Note memory being mapped or unmapped, and track its high-water mark
+     * \arg m The kind of memory
+     * \arg delta The change in bytes mapped
+     */
+    static void mapped(Memory m, int64_t delta);
+
+    /**
+     * \brief Check if a statistics file was requested with STABILIZER_STATS
+     */
+    static bool enabled();
+
+    /**
+     * \brief Write the totals to the statistics file.  Safe to call from
+     * signal handlers.
+     */
+    static void report();
+};
+
+#endif
@@ -0,0 +1,249 @@
+#include "Thread.h"
+#include "Util.h"
+
+volatile size_t Thread::_stopped = 0;
+volatile size_t Thread::_epoch = 0;
+volatile bool Thread::_parking = false;
+PerfCounterGroup* Thread::_countModel = NULL;
+uint64_t Thread::_exitedCounts[PerfCounterGroup::MaxEvents];
+
+/// The registered thread running on this pthread
+static __thread Thread* _current = NULL;
+
+/**
+ * The entry point and argument for a new thread
+ */
+struct ThreadStart {
+    void*(*fn)(void*);
+    void* arg;
+};
+
+SpinLock& getRuntimeLock() {
+    static SpinLock _lock;
+    return _lock;
+}
+
+Thread::Thread(void** top) : _thread(pthread_self()), _top(top), _context(NULL), _parked(NULL), _claimed((size_t)-1), _counters(NULL) {
+    // Opened before the thread is registered, so readEvents() sees a complete group
+    if(_countModel != NULL) {
+        _counters = new PerfCounterGroup();
+        if(!_counters->openLike(_countModel)) {
+            delete _counters;
+            _counters = NULL;
+        }
+    }
+    
+    getRuntimeLock().lock();
+    getRegistry().insert(this);
+    _current = this;
+    getRuntimeLock().unlock();
+}
+
+Thread::~Thread() {
+    getRuntimeLock().lock();
+    getRegistry().erase(this);
+    
+    // Keep the thread's final counts, so totals never go backward
+    uint64_t values[PerfCounterGroup::MaxEvents];
+    if(_counters != NULL && _counters->read(values)) {
+        for(size_t i=0; i<_counters->size(); i++) {
+            _exitedCounts[i] += values[i];
+        }
+    }
+    _current = NULL;
+    getRuntimeLock().unlock();
+    
+    if(_counters != _countModel) {
+        delete _counters;
+    }
+}
+
+void Thread::countEvents(PerfCounterGroup* group) {
+    _current->_counters = group;
+    _countModel = group;
+}
+
+void Thread::readEvents(uint64_t* values) {
+    size_t count = _countModel != NULL ? _countModel->size() : 0;
+    for(size_t i=0; i<count; i++) {
+        values[i] = _exitedCounts[i];
+    }
+    
+    uint64_t threadValues[PerfCounterGroup::MaxEvents];
+    for(set<Thread*>::iterator iter = getRegistry().begin(); iter != getRegistry().end(); iter++) {
+        PerfCounterGroup* g = (*iter)->_counters;
+        if(g != NULL && g->read(threadValues)) {
+            for(size_t i=0; i<count; i++) {
+                values[i] += threadValues[i];
+            }
+        }
+    }
+}
+
+void Thread::init() {
+    pthread_atfork(Thread::beforeFork, Thread::afterForkParent, Thread::afterForkChild);
+}
+
+void Thread::beforeFork() {
+    getRuntimeLock().lock();
+}
+
+void Thread::afterForkParent() {
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Drop every thread but the forking one.  The dropped threads' objects are
+ * left allocated, since the threads never run in the child to free them.
+ */
+void Thread::afterForkChild() {
+    set<Thread*>::iterator iter = getRegistry().begin();
+    while(iter != getRegistry().end()) {
+        if(*iter != _current) {
+            getRegistry().erase(iter++);
+        } else {
+            iter++;
+        }
+    }
+    
+    getRuntimeLock().unlock();
+}
+
+Thread* Thread::current() {
+    return _current;
+}
+
+int Thread::create(pthread_t* thread, const pthread_attr_t* attr, void*(*fn)(void*), void* arg) {
+    ThreadStart* s = new ThreadStart;
+    s->fn = fn;
+    s->arg = arg;
+    
+    int r = pthread_create(thread, attr, Thread::start, s);
+    
+    if(r != 0) {
+        delete s;
+    }
+    
+    return r;
+}
+
+/**
+ * Run a thread's entry point with the thread registered.  Program frames are
+ * always below this frame, so it bounds the thread's stack scan.
+ */
+void* Thread::start(void* arg) {
+    ThreadStart s = *(ThreadStart*)arg;
+    delete (ThreadStart*)arg;
+    
+    Thread* t = new Thread((void**)__builtin_frame_address(0));
+    void* result;
+    
+    // Unregister even if the thread calls pthread_exit or is cancelled
+    pthread_cleanup_push(Thread::finish, t);
+    result = s.fn(s.arg);
+    pthread_cleanup_pop(1);
+    
+    return result;
+}
+
+void Thread::finish(void* arg) {
+    delete (Thread*)arg;
+}
+
+/**
+ * Take the job of stopping this thread in an epoch.  A thread that parks
+ * itself and the thread that would signal it race for the same claim, so only
+ * one of them counts it as stopped.
+ * \returns False if the thread was already claimed in this epoch
+ */
+bool Thread::claim(size_t epoch) {
+    size_t last = _claimed;
+    return last != epoch && __sync_bool_compare_and_swap(&_claimed, last, epoch);
+}
+
+void Thread::stopAll(uint64_t parkWait) {
+    size_t epoch = _epoch;
+    size_t count = 0;
+    _stopped = 0;
+    
+    for(set<Thread*>::iterator iter = getRegistry().begin(); iter != getRegistry().end(); iter++) {
+        if(*iter != _current) {
+            count++;
+        }
+    }
+    
+    // Let threads in instrumented code stop at their next poll.  Stop waiting
+    // once none has arrived for parkWait, since the rest may never poll.
+    if(parkWait > 0 && count > 0) {
+        size_t parked = 0;
+        uint64_t last = getTime();
+        _parking = true;
+        
+        while(_stopped < count && getTime() - last < parkWait) {
+            if(_stopped != parked) {
+                parked = _stopped;
+                last = getTime();
+            }
+            sched_yield();
+        }
+    }
+    
+    // The rest are blocked, or running code without polls
+    for(set<Thread*>::iterator iter = getRegistry().begin(); iter != getRegistry().end(); iter++) {
+        Thread* t = *iter;
+        if(t != _current && t->claim(epoch)) {
+            pthread_kill(t->_thread, StopSignal);
+        }
+    }
+    
+    while(_stopped < count) {
+        sched_yield();
+    }
+}
+
+void Thread::resumeAll() {
+    _parking = false;
+    __sync_fetch_and_add(&_epoch, 1);
+}
+
+void Thread::onStop(int sig, siginfo_t* info, void* p) {
+    Thread* t = _current;
+    
+    // Only registered threads are ever signalled
+    if(t == NULL) {
+        return;
+    }
+    
+    size_t epoch = _epoch;
+    t->_context = p;
+    __sync_fetch_and_add(&_stopped, 1);
+    
+    while(_epoch == epoch) {
+        sched_yield();
+    }
+    
+    t->_context = NULL;
+}
+
+bool Thread::park() {
+    size_t epoch = _epoch;
+    
+    if(!_parking || !claim(epoch)) {
+        return false;
+    }
+    
+    // This frame is below the poll's, and below the registers it spilled
+    _parked = (void**)__builtin_frame_address(0);
+    __sync_fetch_and_add(&_stopped, 1);
+    
+    while(_epoch == epoch) {
+        sched_yield();
+    }
+    
+    _parked = NULL;
+    return true;
+}
+
+void Thread::enterSafepoint() {
+    _parked = (void**)__builtin_frame_address(0);
+}
@@ -0,0 +1,227 @@
+#if !defined(RUNTIME_THREAD_H)
+#define RUNTIME_THREAD_H
+
+#include <set>
+#include <sched.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "Arch.h"
+#include "Context.h"
+#include "PerfCounter.h"
+
+using namespace std;
+
+/**
+ * A minimal lock that is safe to acquire from signal handlers
+ */
+struct SpinLock {
+private:
+    volatile int _locked;
+    
+public:
+    SpinLock() : _locked(0) {}
+    
+    inline void lock() {
+        while(__sync_lock_test_and_set(&_locked, 1)) {
+            sched_yield();
+        }
+    }
+    
+    inline bool trylock() {
+        return __sync_lock_test_and_set(&_locked, 1) == 0;
+    }
+    
+    inline void unlock() {
+        __sync_lock_release(&_locked);
+    }
+};
+
+/**
+ * \brief Get the lock that serializes all changes to runtime state: function
+ * locations, function headers, and the thread registry.
+ */
+SpinLock& getRuntimeLock();
+
+/**
+ * A program thread known to the runtime.  Threads are registered when they
+ * start (see stabilizer_pthread_create) so their stacks can be scanned for
+ * references to relocated code.
+ * 
+ * Threads that block StopSignal, or threads created without going through
+ * stabilizer_pthread_create, cannot be stopped or scanned.
+ * 
+ * When an epoch ends at a safepoint, threads running instrumented code stop
+ * themselves at their next poll (see park()).  Only threads that don't reach
+ * a poll in time are stopped with StopSignal.
+ */
+struct Thread {
+public:
+    /// Signal used to stop other threads while the runtime rewrites code
+#if IS_OSX
+    enum { StopSignal = SIGXCPU };
+#else
+    enum { StopSignal = SIGPWR };
+#endif
+    
+private:
+    pthread_t _thread;
+    void** _top;            //< The highest frame that may hold a program return address
+    void* volatile _context; //< The signal context of a stopped thread, or NULL while running
+    void** volatile _parked; //< The lowest stack slot to scan while parked at a poll, or NULL
+    volatile size_t _claimed;   //< The last epoch this thread was stopped in, by a poll or a signal
+    PerfCounterGroup* _counters;    //< Counts this thread's events, or NULL
+    
+    static volatile size_t _stopped;    //< The number of threads that have acknowledged a stop
+    static volatile size_t _epoch;      //< Incremented to release stopped threads
+    static volatile bool _parking;      //< Set while stopAll() waits for threads to park at polls
+    
+    static PerfCounterGroup* _countModel;   //< The events each new thread counts, or NULL
+    static uint64_t _exitedCounts[PerfCounterGroup::MaxEvents]; //< Events counted by threads that have exited
+    
+    static inline set<Thread*>& getRegistry() {
+        static set<Thread*> _registry;
+        return _registry;
+    }
+    
+    bool claim(size_t epoch);
+    
+    static void* start(void* arg);
+    static void finish(void* arg);
+    
+    static void beforeFork();
+    static void afterForkParent();
+    static void afterForkChild();
+    
+public:
+    /**
+     * \brief Register the calling thread
+     * \arg top The frame address of the thread's entry point
+     */
+    Thread(void** top);
+    
+    /**
+     * \brief Unregister this thread
+     */
+    ~Thread();
+    
+    /**
+     * \brief Install fork handlers.  The runtime lock is held across fork(),
+     * and a child process keeps only the forking thread in the registry, since
+     * the others don't exist there.
+     */
+    static void init();
+    
+    /**
+     * \brief Count a group's events in every registered thread.  The calling
+     * thread uses the group itself, and each thread registered later opens a
+     * group with the same events.  Must be called before other threads start.
+     * \arg group A group opened by the calling thread
+     */
+    static void countEvents(PerfCounterGroup* group);
+    
+    /**
+     * \brief Total the events counted by all registered threads, and by
+     * threads that have exited.  Threads that couldn't open their own group
+     * are missing from the total.  Must be called with the runtime lock held.
+     * \arg values Receives one count per event in the group
+     */
+    static void readEvents(uint64_t* values);
+    
+    /**
+     * \brief Get the calling thread
+     * \returns The registered thread, or NULL if the calling thread was not registered
+     */
+    static Thread* current();
+    
+    static inline set<Thread*>& all() {
+        return getRegistry();
+    }
+    
+    /**
+     * \brief Create a thread that is registered with the runtime while it runs
+     */
+    static int create(pthread_t* thread, const pthread_attr_t* attr, void*(*fn)(void*), void* arg);
+    
+    /**
+     * \brief Stop every other registered thread.  Must be called with the runtime
+     * lock held.  Nothing may be allocated or freed until resumeAll(), since a
+     * stopped thread may hold an allocator lock.
+     * \arg parkWait Microseconds to wait for another thread to park at a poll
+     * before signalling the rest, or zero to signal every thread at once
+     */
+    static void stopAll(uint64_t parkWait = 0);
+    
+    /**
+     * \brief Release all threads stopped by stopAll()
+     */
+    static void resumeAll();
+    
+    /**
+     * \brief Handler for StopSignal: publish this thread's context and wait to be released
+     */
+    static void onStop(int sig, siginfo_t* info, void* p);
+    
+    /**
+     * \brief Stop the calling thread at a poll if stopAll() is waiting for it,
+     * and wait to be released.  The caller must have spilled its callee-saved
+     * registers (see __builtin_unwind_init), so every program value the thread
+     * holds is on the stack above this frame.
+     * \returns False if no stop was waiting for this thread
+     */
+    bool park();
+    
+    /**
+     * \brief Publish the calling thread's stack like a parked thread's, for the
+     * thread that ends the epoch at a poll.  Same requirements as park().
+     */
+    void enterSafepoint();
+    
+    /**
+     * \brief Withdraw the stack published by enterSafepoint()
+     */
+    inline void leaveSafepoint() {
+        _parked = NULL;
+    }
+    
+    inline void** getTop() {
+        return _top;
+    }
+    
+    inline bool isStopped() {
+        return _context != NULL;
+    }
+    
+    /**
+     * \brief Check if this thread is parked at a poll, or is ending the epoch at one
+     */
+    inline bool isParked() {
+        return _parked != NULL;
+    }
+    
+    /**
+     * \brief Get the lowest stack slot of a parked thread.  Everything from
+     * here to getTop() may hold a program value.
+     */
+    inline void** getParkedStack() {
+        return _parked;
+    }
+    
+    /**
+     * \brief Get the context of a stopped thread.  Changes to the context take
+     * effect when the thread is resumed.
+     */
+    inline Context getContext() {
+        return Context(_context);
+    }
+    
+    /**
+     * \brief Get the raw signal context of a stopped thread, which holds its saved registers
+     */
+    inline void* getContextBase() {
+        return _context;
+    }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "Timer.h"
+#include "Debug.h"
+
+#include <string.h>
+#include <sys/time.h>
+
+#if IS_LINUX
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+Timer::Clock Timer::_clock = Timer::RealClock;
+int Timer::_signal = SIGALRM;
+
+#if IS_LINUX
+static timer_t _timer;      //< The POSIX timer for the CPU time clocks
+static int _counter = -1;   //< The perf event file descriptor for InstructionClock
+#endif
+
+/**
+ * Create a POSIX timer on a CPU time clock that signals with a realtime signal
+ */
+bool Timer::initPOSIX(Clock c) {
+#if IS_LINUX
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_SIGNAL;
+    ev.sigev_signo = SIGRTMIN + 1;
+
+    clockid_t id = c == ThreadCPUClock ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID;
+
+    if(timer_create(id, &ev, &_timer) != 0) {
+        DEBUG("Unable to create %s timer", getName(c));
+        return false;
+    }
+
+    _clock = c;
+    _signal = SIGRTMIN + 1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Open a retired instruction counter for the calling thread that signals once
+ * it overflows.  The counter stays disabled until the timer is set.
+ */
+bool Timer::initInstructions() {
+#if IS_LINUX
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    pe.sample_period = InstructionsPerMsec;
+    pe.wakeup_events = 1;
+
+    int fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+
+    if(fd == -1) {
+        DEBUG("Unable to open a retired instruction counter");
+        return false;
+    }
+
+    // Deliver overflow signals to this thread, not whichever thread the kernel picks
+    struct f_owner_ex owner;
+    owner.type = F_OWNER_TID;
+    owner.pid = syscall(__NR_gettid);
+
+    if(fcntl(fd, F_SETFL, O_ASYNC) == -1 || fcntl(fd, F_SETSIG, SIGRTMIN + 1) == -1 || fcntl(fd, F_SETOWN_EX, &owner) == -1) {
+        DEBUG("Unable to route instruction counter overflows to a signal");
+        close(fd);
+        return false;
+    }
+
+    _counter = fd;
+    _clock = InstructionClock;
+    _signal = SIGRTMIN + 1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Timer::init(const char* name) {
+    if(name == NULL || strcmp(name, "real") == 0) {
+        _clock = RealClock;
+        _signal = SIGALRM;
+
+    } else if(strcmp(name, "prof") == 0) {
+        _clock = ProfClock;
+        _signal = SIGPROF;
+
+    } else if(strcmp(name, "process") == 0) {
+        if(!initPOSIX(ProcessCPUClock)) {
+            init("prof");
+        }
+
+    } else if(strcmp(name, "thread") == 0) {
+        if(!initPOSIX(ThreadCPUClock)) {
+            init("prof");
+        }
+
+    } else if(strcmp(name, "instructions") == 0) {
+        if(!initInstructions()) {
+            init("thread");
+        }
+
+    } else {
+        ABORT("Unknown re-randomization clock '%s'", name);
+    }
+}
+
+void Timer::set(int msec) {
+    if(_clock == RealClock || _clock == ProfClock) {
+        struct itimerval timer;
+
+        timer.it_value.tv_sec = (msec - msec % 1000) / 1000;
+        timer.it_value.tv_usec = 1000 * (msec % 1000);
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = 0;
+
+        setitimer(_clock == RealClock ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+        return;
+    }
+
+#if IS_LINUX
+    if(_clock == InstructionClock) {
+        uint64_t period = (uint64_t)msec * InstructionsPerMsec;
+
+        // Count from zero and disable the counter again after one overflow
+        ioctl(_counter, PERF_EVENT_IOC_DISABLE, 0);
+        if(msec == 0) {
+            return;
+        }
+        ioctl(_counter, PERF_EVENT_IOC_PERIOD, &period);
+        ioctl(_counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_counter, PERF_EVENT_IOC_REFRESH, 1);
+        return;
+    }
+
+    struct itimerspec timer;
+
+    timer.it_value.tv_sec = msec / 1000;
+    timer.it_value.tv_nsec = 1000000L * (msec % 1000);
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_nsec = 0;
+
+    timer_settime(_timer, 0, &timer, NULL);
+#endif
+}
+
+const char* Timer::getName(Clock c) {
+    switch(c) {
+        case RealClock: return "real";
+        case ProfClock: return "prof";
+        case ProcessCPUClock: return "process";
+        case ThreadCPUClock: return "thread";
+        case InstructionClock: return "instructions";
+    }
+    return "unknown";
+}
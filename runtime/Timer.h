@@ -0,0 +1,68 @@
+#if !defined(RUNTIME_TIMER_H)
+#define RUNTIME_TIMER_H
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "Arch.h"
+
+/**
+ * The one-shot re-randomization timer.  The clock that drives it decides what
+ * an epoch measures: wall-clock time, CPU time, or retired instructions.
+ *
+ * The thread and instruction clocks count the work of the thread that
+ * initialized the timer (the main thread).  Clocks that are not available on
+ * this platform or kernel fall back to the closest clock that is.
+ */
+struct Timer {
+public:
+    enum Clock {
+        RealClock,          //< Wall-clock time (ITIMER_REAL)
+        ProfClock,          //< Process user and system time (ITIMER_PROF)
+        ProcessCPUClock,    //< Process CPU time (timer_create on CLOCK_PROCESS_CPUTIME_ID)
+        ThreadCPUClock,     //< Main thread CPU time (timer_create on CLOCK_THREAD_CPUTIME_ID)
+        InstructionClock    //< Main thread retired instructions (perf_event_open)
+    };
+
+    /// Instructions counted per millisecond of interval by InstructionClock
+    enum { InstructionsPerMsec = 1000000 };
+
+private:
+    static Clock _clock;
+    static int _signal;
+
+    static bool initPOSIX(Clock c);
+    static bool initInstructions();
+
+public:
+    /**
+     * \brief Select the clock that drives the timer.  Must be called before the
+     * timer signal's handler is installed.
+     * \arg name The clock name: "real", "prof", "process", "thread", or "instructions".
+     * NULL selects the real clock.
+     */
+    static void init(const char* name);
+
+    /**
+     * \brief Arm the timer to fire once
+     * \arg msec The interval in milliseconds of the selected clock, or
+     * InstructionsPerMsec instructions per millisecond for InstructionClock.
+     * Zero disarms the timer.
+     */
+    static void set(int msec);
+
+    /**
+     * \brief Get the signal delivered when the timer fires
+     */
+    static inline int getSignal() {
+        return _signal;
+    }
+
+    static inline Clock getClock() {
+        return _clock;
+    }
+
+    static const char* getName(Clock c);
+};
+
+#endif
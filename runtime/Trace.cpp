@@ -0,0 +1,90 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "Trace.h"
+#include "Config.h"
+#include "Util.h"
+#include "Debug.h"
+
+Trace::Trace() : _header(NULL), _entries(NULL), _epoch(0) {
+    const char* path = Config::get("STABILIZER_TRACE");
+    if(path == NULL) {
+        return;
+    }
+
+    size_t sz = sizeof(Header) + Capacity * sizeof(Entry);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || ftruncate(fd, sz) != 0) {
+        perror("open");
+        ABORT("Couldn't create the layout trace %s", path);
+    }
+
+    void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        ABORT("Couldn't map the layout trace %s", path);
+    }
+
+    _header = (Header*)p;
+    _entries = (Entry*)&_header[1];
+
+    _header->capacity = Capacity;
+    _header->head = 0;
+    _header->start = getTime();
+    _header->magic = Magic;
+
+    append(EpochStart, 0, 0, 0);
+}
+
+Trace& Trace::get() {
+    static Trace _trace;
+    return _trace;
+}
+
+/**
+ * Claim the next slot in the ring and fill it.  The kind is written last, so
+ * the decoder can tell a slot that was never finished from a complete entry.
+ */
+void Trace::append(Kind k, uint64_t a, uint64_t b, uint64_t c) {
+    uint64_t n = __sync_fetch_and_add(&_header->head, 1);
+    Entry* e = &_entries[n % Capacity];
+
+    e->kind = Empty;
+    __sync_synchronize();
+
+    e->epoch = _epoch;
+    e->a = a;
+    e->b = b;
+    e->c = c;
+
+    __sync_synchronize();
+    e->kind = k;
+}
+
+void Trace::epoch() {
+    Trace& t = get();
+    if(t._header != NULL) {
+        t._epoch++;
+        t.append(EpochStart, getTime() - t._header->start, 0, 0);
+    }
+}
+
+void Trace::move(void* original, void* copy, uint8_t pad) {
+    Trace& t = get();
+    if(t._header != NULL) {
+        t.append(Move, (uintptr_t)original, (uintptr_t)copy, pad);
+    }
+}
+
+void Trace::arena(void* base, size_t sz) {
+    Trace& t = get();
+    if(t._header != NULL) {
+        t.append(Arena, (uintptr_t)base, sz, 0);
+    }
+}
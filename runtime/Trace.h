@@ -0,0 +1,89 @@
+#if !defined(RUNTIME_TRACE_H)
+#define RUNTIME_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A binary trace of the layouts a run used, for offline analysis with
+ * sztrace.  The trace is a ring of fixed-size entries in a shared file
+ * mapping, so appending is a few stores and the kernel writes the file back
+ * in the background.  Once the ring is full, the oldest entries are
+ * overwritten.
+ *
+ * Tracing is enabled by setting STABILIZER_TRACE to a file name.  This
+ * header is also used by the decoder, so it only depends on the C library.
+ */
+struct Trace {
+public:
+    static const uint64_t Magic = 0x3145434152545a53ull;    //< "SZTRACE1"
+
+    enum { Capacity = 1 << 18 };    //< Entries in the ring, 8MB of file
+
+    enum Kind {
+        Empty,
+        EpochStart,     //< a: microseconds since the trace was opened
+        Move,           //< a: original function address, b: new copy, c: stack pad
+        Arena           //< a: base of a data heap arena, b: its size
+    };
+
+    struct Header {
+        uint64_t magic;
+        uint64_t capacity;  //< The number of entries in the ring
+        uint64_t head;      //< Entries appended over the whole run
+        uint64_t start;     //< Wall-clock time the trace was opened, in microseconds
+    };
+
+    struct Entry {
+        uint32_t kind;
+        uint32_t epoch;
+        uint64_t a;
+        uint64_t b;
+        uint64_t c;
+    };
+
+private:
+    Header* _header;
+    Entry* _entries;
+    uint32_t _epoch;
+
+    Trace();
+
+    void append(Kind k, uint64_t a, uint64_t b, uint64_t c);
+
+    /**
+     * \brief Get the process's trace.  The trace is opened on first use,
+     * since heap arenas are mapped by module constructors before main runs.
+     */
+    static Trace& get();
+
+public:
+    /**
+     * \brief Check if a trace file was requested with STABILIZER_TRACE
+     */
+    static inline bool enabled() {
+        return get()._header != NULL;
+    }
+
+    /**
+     * \brief Start a new epoch.  Must be called with the runtime lock held.
+     */
+    static void epoch();
+
+    /**
+     * \brief Log a function's move to a new copy
+     * \arg original The function's original address
+     * \arg copy The base of the new copy
+     * \arg pad The function's stack pad while the copy is current
+     */
+    static void move(void* original, void* copy, uint8_t pad);
+
+    /**
+     * \brief Log a new data heap arena.  Safe to call from any thread.
+     * \arg base The arena base
+     * \arg sz The arena size
+     */
+    static void arena(void* base, size_t sz);
+};
+
+#endif
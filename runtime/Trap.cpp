@@ -0,0 +1,136 @@
+#include "Trap.h"
+
+#if IS_OSX
+#	define ASM_SYMBOL(name) "_" #name
+#	define ASM_HIDDEN ".private_extern "
+#else
+#	define ASM_SYMBOL(name) #name
+#	define ASM_HIDDEN ".hidden "
+#endif
+
+#if IS_X86_64
+#include <cpuid.h>
+#include <stdint.h>
+
+/// The xsave components that can hold arguments: x87, SSE, AVX, and the AVX-512 opmask and zmm state
+enum { ArgumentState = 0xE7 };
+
+/**
+ * Get the components the stub saves with xsave: those enabled by the OS that
+ * can hold arguments.  Other state, such as AMX tiles, isn't used by the
+ * runtime and is left in place.
+ * \returns The xsave mask, or 0 if xsave is unavailable and fxsave must be used
+ */
+static uint32_t getTrapStateMask() {
+    unsigned eax, ebx, ecx, edx;
+    
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+        return 0;
+    }
+    
+    uint32_t lo, hi;
+    asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return lo & ArgumentState;
+}
+
+/**
+ * Get the size of the area the stub saves vector and floating point state
+ * to: the end of the last component in the mask, or the 512 byte fxsave area.
+ */
+static size_t getTrapStateSize(uint32_t mask) {
+    if(mask == 0) {
+        return 512;
+    }
+    
+    // The legacy area and the xsave header come first
+    size_t size = 576;
+    
+    for(unsigned i=2; i<32; i++) {
+        if(mask & (1u << i)) {
+            unsigned eax, ebx, ecx, edx;
+            __cpuid_count(0xD, i, eax, ebx, ecx, edx);
+            
+            if(ebx + eax > size) {
+                size = ebx + eax;
+            }
+        }
+    }
+    
+    return size;
+}
+
+uint32_t stabilizer_trap_state_mask = getTrapStateMask();
+size_t stabilizer_trap_state_size = getTrapStateSize(stabilizer_trap_state_mask);
+
+/**
+ * Entry stub for X86_64StubTrap.  Called from the header of a trapped function
+ * with the stack exactly as the function's caller left it, plus the return
+ * address pushed by the trap's call instruction.
+ * 
+ * 1. Build a frame and save every general purpose register that can carry arguments
+ * 2. Save the vector state with xsave, or fxsave if xsave is unavailable.
+ *    Arguments passed in ymm and zmm registers need their upper halves,
+ *    which runtime code such as memcpy clobbers.
+ * 3. Call stabilizer_trap_entry(&return slot, entry stack pointer, caller's frame),
+ *    which overwrites the return slot with the relocated function's address
+ * 4. Restore registers and "return" into the relocated function
+ */
+asm(
+    ".text\n"
+    ".globl " ASM_SYMBOL(stabilizer_trap_stub) "\n"
+    ASM_HIDDEN ASM_SYMBOL(stabilizer_trap_stub) "\n"
+    ASM_SYMBOL(stabilizer_trap_stub) ":\n"
+    "   pushq %rbp\n"
+    "   movq %rsp, %rbp\n"
+    "   pushq %rax\n"
+    "   pushq %rdi\n"
+    "   pushq %rsi\n"
+    "   pushq %rdx\n"
+    "   pushq %rcx\n"
+    "   pushq %r8\n"
+    "   pushq %r9\n"
+    "   pushq %r10\n"
+    "   movq " ASM_SYMBOL(stabilizer_trap_state_size) "(%rip), %rcx\n"
+    "   subq %rcx, %rsp\n"
+    "   andq $-64, %rsp\n"
+    "   cmpl $0, " ASM_SYMBOL(stabilizer_trap_state_mask) "(%rip)\n"
+    "   je 1f\n"
+    // xrstor faults unless the rest of the xsave header is zero
+    "   xorl %eax, %eax\n"
+    "   movq %rax, 512(%rsp)\n"
+    "   movq %rax, 520(%rsp)\n"
+    "   movq %rax, 528(%rsp)\n"
+    "   movq %rax, 536(%rsp)\n"
+    "   movq %rax, 544(%rsp)\n"
+    "   movq %rax, 552(%rsp)\n"
+    "   movq %rax, 560(%rsp)\n"
+    "   movq %rax, 568(%rsp)\n"
+    "   movl " ASM_SYMBOL(stabilizer_trap_state_mask) "(%rip), %eax\n"
+    "   xorl %edx, %edx\n"
+    "   xsave (%rsp)\n"
+    "   jmp 2f\n"
+    "1: fxsave (%rsp)\n"
+    "2: leaq 8(%rbp), %rdi\n"
+    "   leaq 16(%rbp), %rsi\n"
+    "   movq 0(%rbp), %rdx\n"
+    "   call " ASM_SYMBOL(stabilizer_trap_entry) "\n"
+    "   cmpl $0, " ASM_SYMBOL(stabilizer_trap_state_mask) "(%rip)\n"
+    "   je 3f\n"
+    "   movl " ASM_SYMBOL(stabilizer_trap_state_mask) "(%rip), %eax\n"
+    "   xorl %edx, %edx\n"
+    "   xrstor (%rsp)\n"
+    "   jmp 4f\n"
+    "3: fxrstor (%rsp)\n"
+    "4: leaq -64(%rbp), %rsp\n"
+    "   popq %r10\n"
+    "   popq %r9\n"
+    "   popq %r8\n"
+    "   popq %rcx\n"
+    "   popq %rdx\n"
+    "   popq %rsi\n"
+    "   popq %rdi\n"
+    "   popq %rax\n"
+    "   popq %rbp\n"
+    "   ret\n"
+);
+#endif
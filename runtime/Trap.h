@@ -2,6 +2,8 @@
 #define RUNTIME_TRAP_H
 
 #include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "Arch.h"
 
@@ -17,6 +19,46 @@ struct X86Trap {
     
 } __attribute__((packed));
 
+extern "C" {
+    /// Register-saving entry point for functions trapped with X86_64StubTrap (see Trap.cpp)
+    void stabilizer_trap_stub() __attribute__((visibility("hidden")));
+    
+    /// The xsave components saved by stabilizer_trap_stub, or 0 to use fxsave
+    extern uint32_t stabilizer_trap_state_mask __attribute__((visibility("hidden")));
+    
+    /// Bytes of vector state saved by stabilizer_trap_stub
+    extern size_t stabilizer_trap_state_size __attribute__((visibility("hidden")));
+    
+    /// Relocate a stub-trapped function and write its new address into the stub's return slot
+    void stabilizer_trap_entry(void** slot, void* sp, void* fp) __attribute__((visibility("hidden")));
+
+}
+
+/**
+ * A trap that enters the runtime without a signal.  The trap loads the address
+ * of stabilizer_trap_stub into %r11 (a scratch register at function entry) and
+ * calls it.  The stub saves argument registers, including the full vector
+ * state, and passes the pushed return address, which points just past this
+ * trap, to the runtime.
+ */
+struct X86_64StubTrap {
+    volatile uint16_t movabs_r11;
+    volatile uint64_t target;
+    volatile uint8_t call_r11[3];
+    
+    enum { TrapSignal = 0 };
+    enum { TrapAdjust = 13 };
+    
+    X86_64StubTrap() {
+        movabs_r11 = 0xBB49;    // movabs $target, %r11
+        target = (uint64_t)&stabilizer_trap_stub;
+        call_r11[0] = 0x41;     // call *%r11
+        call_r11[1] = 0xFF;
+        call_r11[2] = 0xD3;
+    }
+    
+} __attribute__((packed));
+
 struct PPCTrap {
     uint32_t trap_opcode;
     
@@ -32,7 +74,7 @@ struct PPCTrap {
 #if IS_X86
 	typedef X86Trap Trap;
 #elif IS_X86_64
-	typedef X86Trap Trap;
+	typedef X86_64StubTrap Trap;
 #elif IS_PPC
 	typedef PPCTrap Trap;
 #endif
@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 #include <sys/mman.h>
-#include <randomnumbergenerator.h>
+#include <sys/time.h>
 
 #include "Arch.h"
 
@@ -34,23 +34,14 @@ static void flush_icache(void* begin, size_t size) {
     )
 }
 
-static inline uint8_t getRandomByte() {
-    static RandomNumberGenerator _rng;
-    static uint8_t _randCount = 0;
-    
-    static union {
-        uint8_t _rands[sizeof(int)];
-        int _bigRand;
-    };
-    
-    if(_randCount == sizeof(int)) {
-        _bigRand = _rng.next();
-        _randCount = sizeof(int);
-    }
-    
-    uint8_t r = _rands[_randCount];
-    _randCount++;
-    return r;
+/**
+ * \brief Get the current wall-clock time
+ * \returns The time in microseconds
+ */
+static inline uint64_t getTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
 #endif
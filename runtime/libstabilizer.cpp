@@ -1,15 +1,33 @@
+#include <map>
 #include <set>
+#include <list>
 #include <vector>
 #include <math.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <execinfo.h>
+#include <dlfcn.h>
+#include <algorithm>
 
 #include "Function.h"
 #include "FunctionLocation.h"
+#include "FunctionTable.h"
 #include "Debug.h"
 #include "Heap.h"
 #include "Context.h"
+#include "Thread.h"
+#include "Timer.h"
+#include "PerfCounter.h"
+#include "Pool.h"
+#include "Random.h"
+#include "Trace.h"
+#include "PerfMap.h"
+#include "Profiler.h"
+#include "Stats.h"
+#include "Config.h"
 
 using namespace std;
  
@@ -20,55 +38,415 @@ int main(int argc, char** argv);
 void onTrap(int sig, siginfo_t* info, void*);
 void onTimer(int sig, siginfo_t* info, void*);
 void onFault(int sig, siginfo_t* info, void*);
+void onProfile(int sig, siginfo_t* info, void*);
+void onStats(int sig, siginfo_t* info, void*);
 
+void* trapped(void* ip, void* sp, void* fp);
+void endEpoch(void* context, void* ip, void* sp, void* fp);
+void markStack(void* ip, void* sp, void* fp);
+void retargetStack(void* sp, void* fp, void** top);
+void scanStack(void* context, void** top);
+void scanParkedStack(void** bottom, void** top);
+void scanThreads();
+void restartThreads(Function* f);
 void setTimer(int msec);
+void nextEpoch();
+void chargeOverhead(uint64_t start);
+void logIntervals();
+void reportPages();
+void rotateRegions();
+void randomizeStackPads();
+void sample(void* ip);
+bool moveThisEpoch(Function* f);
+void reportRelocations();
+void shutdown();
+void recordEpoch();
+bool replayDue(bool atTrap);
+void noteMove(Function* f);
+void prepareMoves();
+void loadRecord(const char* path);
+void reportReplay();
+void* originalFunction(void* p);
+const char* profileName(void* f);
+void reportProfile();
+void openCounters(const char* path);
+void recordCounters();
+void reportCounters();
+void wakePrebuilder();
+void* prebuilder(void*);
 void setHandler(int sig, void(*fn)(int, siginfo_t*, void*));
+bool enterHeap();
+void leaveHeap();
+void lockHeap();
+void unlockHeap();
 
 typedef void(*ctor_t)();
 
-set<Function*> functions;
-set<Function*> live_functions;
-set<uint8_t*> stack_pads;
+FunctionTable& functions = FunctionTable::get();  //< Registered functions by ID, with their headers, pads, and sets
+map<uintptr_t, Function*> code_index;   //< Registered functions by original address
+vector<MemRange> stack_pad_tables;     //< Each module's table of stack pads, one byte per function
 vector<ctor_t> constructors;
 
 bool rerandomizing = false;
-size_t interval = 500;
+volatile bool shutting_down = false;    //< Set at exit, once runtime state may be destroyed
+bool eager = false;     //< If true, relocate all live functions when the timer fires
+size_t interval = 500;  //< Milliseconds per epoch
 
-void** topFrame = NULL;
+/*
+ * Module constructors register functions and stack pads before main runs, so
+ * the settings they depend on are read when the runtime is loaded.
+ */
+bool randomize_code = Config::flag("STABILIZER_CODE", true);    //< If false, functions stay in their original code
+bool randomize_stack = Config::flag("STABILIZER_STACK", true);  //< If false, stack pads stay zero
+size_t stack_interval = Config::number("STABILIZER_STACK_INTERVAL", 0);    //< Milliseconds between stack pad refills, or zero to pad each copy of a function
+uint64_t stack_start = 0;   //< Time of the last stack pad refill
+bool retarget = false;      //< If true, return addresses are moved out of defunct copies before each sweep
+bool safepoints = false;    //< If true, epochs end at compiler-inserted polls instead of in the timer handler
+size_t safepoint_wait = 100;    //< Microseconds to wait for another thread to reach a poll before signalling the rest
+
+double budget = 0;          //< Fraction of run time the runtime may use, or zero for a fixed interval
+size_t min_interval = 10;   //< Shortest adaptive interval
+size_t max_interval = 5000; //< Longest adaptive interval, which sets a floor on the epochs sampled per run
+uint64_t epoch_start = 0;
+volatile uint64_t epoch_overhead = 0;   //< Microseconds spent in the runtime during this epoch
+list<size_t, PoolAllocator<size_t> > intervals;    //< The interval chosen for each epoch when the interval is adaptive
+volatile uint64_t total_overhead = 0;   //< Microseconds spent in the runtime over the whole run
+
+PerfCounter* itlb_misses = NULL;    //< Counts iTLB misses when comparing page sizes
+uint64_t registration_time = 0;     //< Microseconds spent preparing functions for patching
+
+size_t cold_period = 0;     //< If nonzero, functions without recent samples move only every cold_period epochs
+size_t epoch_ticks = 0;     //< Timer firings so far in this epoch, when sampling hotness
+
+/// Timer firings per epoch when sampling hotness.  All but the last only sample.
+enum { SamplesPerEpoch = 10 };
+
+/// The position of an epoch boundary in a recorded run
+struct EpochRecord {
+    uint64_t traps;         //< Traps handled before the boundary
+    uint64_t instructions;  //< Instructions retired before the boundary, or zero if not counted
+    uint64_t time;          //< Microseconds since the start of the run
+    size_t moves;           //< Moves recorded before the boundary
+};
+
+uint64_t traps = 0;         //< Traps that relocated a function, which order epoch boundaries for replay
+uint64_t run_start = 0;
+PerfCounter* instructions = NULL;   //< Counts retired instructions when recording or replaying
+int record_fd = -1;         //< The file epoch boundaries are recorded to, or -1
+bool replaying = false;     //< If true, epochs end where they did in a recorded run instead of on a timer
+vector<EpochRecord> replay; //< The recorded epoch boundaries to replay
+vector<size_t> replay_moves;    //< IDs of the functions the recorded run moved, in order
+size_t replay_next = 0;     //< The next boundary to replay
+size_t replay_misses = 0;   //< Moves in the replay that the recorded run did not make
+
+PerfCounterGroup* counters = NULL; //< Counters read at every epoch boundary, if requested
+int counters_fd = -1;       //< The file per-epoch counts are written to
+uint64_t counters_last[PerfCounterGroup::MaxEvents];    //< Counts at the start of this epoch
+uint64_t counters_time = 0; //< Time at the start of this epoch
+size_t counters_epoch = 0;  //< The number of the current epoch
+
+bool prebuild = false;      //< If true, a helper thread builds spare copies of hot functions
+int prebuild_pipe[2];       //< Wakes the helper thread at the start of each epoch
+
+SpinLock heap_lock;         //< Serializes program allocations in the randomized heap
+__thread bool in_heap = false;      //< Set while this thread is inside the randomized heap
+__thread void* deferred_frees = NULL;   //< Heap objects freed by signal handlers that interrupted the heap
 
 /**
  * Entry point for a program run with Stabilizer.  The program's existing
  * main function has been renamed 'stabilizer_main' by the compiler pass.
  * 
- * 1. Save the current top of the stack
- * 2. Set signal handlers for debug traps, timers, and segfaults for error handling
+ * 1. Register the main thread and save the current top of its stack
+ * 2. Set signal handlers for debug traps, timers, thread stops, and segfaults for error handling
  * 3. Place a trap instruction at the start of each randomizable function to trigger relocation on-demand
  * 4. Set the re-randomization timer
  * 5. Call module constructors
  * 6. Invoke stabilizer_main
+ * 
+ * Settings are read from the environment or a configuration file (see
+ * Config).
+ * 
+ * STABILIZER_INTERVAL sets the epoch length in milliseconds (500 by default).
+ * 
+ * STABILIZER_CODE=0 and STABILIZER_STACK=0 turn off code relocation and stack
+ * padding in a program built with them.  Functions are then not registered,
+ * and run from their original code.  Heap settings are in ShuffleLayer.
+ * 
+ * STABILIZER_STACK_INTERVAL=ms refills the stack pad tables at the first
+ * epoch boundary after ms milliseconds, instead of giving each copy of a
+ * function its own pad.  Without code relocation, it sets the epoch length.
+ * 
+ * Setting STABILIZER_EAGER relocates every live function in a single pass
+ * when the re-randomization timer fires, instead of trapping each function
+ * and relocating it on its next call.
+ * 
+ * STABILIZER_CLOCK selects the clock that drives the re-randomization timer
+ * (see Timer::init).  The default is wall-clock time.
+ * 
+ * STABILIZER_BUDGET sets a runtime overhead budget as a percentage.  When it
+ * is set, the interval is adjusted after every epoch to hold the overhead near
+ * the budget, but never beyond STABILIZER_MAX_INTERVAL milliseconds.
+ * 
+ * STABILIZER_HUGEPAGES=1 backs the code and data heaps with 2MB pages (see
+ * HugePages).  With STABILIZER_HUGEPAGES set to any value, iTLB misses and
+ * runtime overhead are reported at exit to compare page sizes.
+ * 
+ * STABILIZER_PREBUILD starts a helper thread that copies hot functions into
+ * the next epoch's code region ahead of time, so relocation at the epoch
+ * boundary only has to patch jumps.
+ * 
+ * STABILIZER_COLD_PERIOD=n samples the running function several times per
+ * epoch.  Functions sampled recently move every epoch, and the rest move only
+ * every n epochs.  Relocation counts are reported at exit.
+ * 
+ * STABILIZER_RECORD=file logs the random seed, every epoch boundary, and the
+ * order functions move in.  STABILIZER_REPLAY=file reruns with the same seed,
+ * boundaries, and moves (see seedRandom, replayDue, and prepareMoves).
+ * 
+ * STABILIZER_TRACE=file writes every placement, stack pad, and heap arena to
+ * a binary trace, grouped by epoch (see Trace).  Decode it with sztrace.
+ * 
+ * STABILIZER_RETARGET=1 rewrites return addresses in defunct copies before
+ * each sweep, so deep frames don't pin old copies (see retargetStack).
+ * 
+ * Programs built with safepoint polls end each epoch at the next poll after
+ * the timer fires, and relocate eagerly (see stabilizer_safepoint).
+ * STABILIZER_SAFEPOINTS=0 ignores the polls.
+ * 
+ * STABILIZER_PERFMAP=1 names relocated code for Linux perf (see PerfMap).
+ * 
+ * STABILIZER_STATS=file writes counts and times of runtime events, and the
+ * peak code and data memory mapped, as JSON at exit and on SIGUSR2 (see
+ * Stats).
+ * 
+ * STABILIZER_PROFILE=file samples call chains on SIGPROF and writes a flat
+ * profile, call graph, and per-epoch profile of the original functions to the
+ * file at exit (see Profiler).
+ * 
+ * STABILIZER_COUNTERS=file reads hardware performance counters at every
+ * epoch boundary and writes each epoch's counts to the file (see
+ * openCounters).
  */
 int main(int argc, char **argv) {
     DEBUG("Initializing Stabilizer");
+    DEBUG("Registered %lu functions in %lu us with %s code",
+        (unsigned long)functions.size(), (unsigned long)registration_time,
+        DualMap::enabled() ? "dual mapped" : "writable");
+    
+    // Size the metadata pools for the registered functions, so handlers don't
+    // have to map more.  Each function may have a current copy, a spare, and
+    // defunct copies waiting to be swept, each with a node in the registry.
+    size_t n = functions.size();
+    Pool<sizeof(FunctionLocation)>::reserve(4 * n + 16);
+    Pool<sizeof(CodeRegion)>::reserve(16);
+    Pool<sizeof(CodeRegionHeapType)>::reserve(4);
+    PoolAllocator<Function*>::reserve(4 * n + 256);
+    DEBUG("Reserved metadata for %lu function locations", (unsigned long)Pool<sizeof(FunctionLocation)>::capacity());
+    
+    // Registered before shutdown so these run after, once no more copies are made by the timer
+    if(PerfMap::enabled()) {
+        atexit(PerfMap::finish);
+        DEBUG("Writing a perf map for relocated code");
+    }
+    
+    if(Stats::enabled()) {
+        atexit(Stats::report);
+        DEBUG("Writing runtime statistics to %s", Config::get("STABILIZER_STATS"));
+    }
+    
+    Thread* mainThread = new Thread((void**)__builtin_frame_address(0));
+    DEBUG("Stack top is at %p", mainThread->getTop());
+    
+    // Opened once the main thread is registered and before others start, so every thread counts its own events
+    if(Config::get("STABILIZER_COUNTERS") != NULL) {
+        openCounters(Config::get("STABILIZER_COUNTERS"));
+        atexit(reportCounters);
+        DEBUG("Writing per-epoch counts of %lu events to %s",
+            (unsigned long)counters->size(), Config::get("STABILIZER_COUNTERS"));
+    }
+    
+    // Installed first, so in a child they run while Thread's handlers still hold the runtime lock
+    if(DualMap::enabled()) {
+        pthread_atfork(NULL, NULL, DualMap::afterForkChild);
+    }
+    if(PerfMap::enabled()) {
+        pthread_atfork(NULL, NULL, PerfMap::afterForkChild);
+    }
+    Thread::init();
+    
+    // Installed after Thread's handlers, so a fork takes the heap lock before the runtime lock
+    pthread_atfork(lockHeap, unlockHeap, unlockHeap);
+    
+    // Runs before the destructors of runtime state created so far
+    atexit(shutdown);
+    
+    eager = Config::flag("STABILIZER_EAGER", false);
+    
+    // Record and replay place epoch boundaries at traps
+    if(safepoints && (Config::get("STABILIZER_RECORD") != NULL || Config::get("STABILIZER_REPLAY") != NULL)) {
+        DEBUG("Ignoring safepoints to record or replay the layout");
+        safepoints = false;
+    }
+    
+    // Functions are never re-trapped, so a safepoint moves every live function at once
+    if(safepoints) {
+        eager = true;
+        safepoint_wait = Config::number("STABILIZER_SAFEPOINT_WAIT", safepoint_wait);
+        DEBUG("Ending epochs at safepoints");
+    }
+    
+    DEBUG("Using %s relocation", eager ? "eager" : "lazy");
+    
+    interval = Config::number("STABILIZER_INTERVAL", interval);
+    if(!randomize_code && stack_interval > 0) {
+        interval = stack_interval;
+    }
+    
+    if(interval == 0) {
+        ABORT("Invalid re-randomization interval %lu ms", (unsigned long)interval);
+    }
+    
+    DEBUG("Randomizing %s%s every %lu ms", randomize_code ? "code" : "no code",
+        randomize_stack ? " and stack pads" : "", (unsigned long)interval);
+    
+    Timer::init(Config::get("STABILIZER_CLOCK"));
+    DEBUG("Using the %s clock for re-randomization", Timer::getName(Timer::getClock()));
+    
+    if(Config::get("STABILIZER_BUDGET") != NULL) {
+        budget = atof(Config::get("STABILIZER_BUDGET")) / 100;
+        
+        if(Config::get("STABILIZER_MAX_INTERVAL") != NULL) {
+            max_interval = Config::number("STABILIZER_MAX_INTERVAL", max_interval);
+        }
+        
+        if(budget <= 0 || max_interval < min_interval) {
+            ABORT("Invalid overhead budget %s%% or maximum interval %lu ms",
+                Config::get("STABILIZER_BUDGET"), (unsigned long)max_interval);
+        }
+        
+        DEBUG("Adapting the interval to a %.2f%% overhead budget", budget * 100);
+        atexit(logIntervals);
+    }
+    
+    if(Config::get("STABILIZER_HUGEPAGES") != NULL) {
+        itlb_misses = new PerfCounter(PerfCounter::ITLBMisses);
+        atexit(reportPages);
+    }
+    
+    if(Config::get("STABILIZER_COLD_PERIOD") != NULL) {
+        cold_period = Config::number("STABILIZER_COLD_PERIOD", 0);
+        
+        if(cold_period == 0) {
+            ABORT("Invalid cold function period %s", Config::get("STABILIZER_COLD_PERIOD"));
+        }
+        
+        DEBUG("Moving unsampled functions every %lu epochs", (unsigned long)cold_period);
+        atexit(reportRelocations);
+    }
+    
+    prebuild = Config::flag("STABILIZER_PREBUILD", false);
+    
+    retarget = Config::flag("STABILIZER_RETARGET", false);
+    if(retarget) {
+        DEBUG("Retargeting return addresses out of defunct copies");
+    }
+    
+    if(Config::get("STABILIZER_RECORD") != NULL || Config::get("STABILIZER_REPLAY") != NULL) {
+        // Both depend on the order of placements, which sampling and the helper thread make timing-dependent
+        if(cold_period > 0 || prebuild) {
+            ABORT("Layouts can't be recorded or replayed with STABILIZER_COLD_PERIOD or STABILIZER_PREBUILD");
+        }
+        
+        run_start = getTime();
+        instructions = new PerfCounter(PerfCounter::Instructions);
+        
+        if(!instructions->isAvailable()) {
+            DEBUG("Instruction counter unavailable, timing epochs by wall-clock time");
+        }
+    }
+    
+    if(Config::get("STABILIZER_RECORD") != NULL) {
+        record_fd = open(Config::get("STABILIZER_RECORD"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(record_fd == -1) {
+            perror("open");
+            ABORT("Couldn't open the layout record %s", Config::get("STABILIZER_RECORD"));
+        }
+        
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "seed %llx\nmode %s\n",
+            (unsigned long long)Random::getSeed(), eager ? "eager" : "lazy");
+        if(write(record_fd, buf, n) != n) {
+            perror("write");
+        }
+        
+        DEBUG("Recording the layout to %s", Config::get("STABILIZER_RECORD"));
+    }
+    
+    if(Trace::enabled()) {
+        DEBUG("Tracing layouts to %s", Config::get("STABILIZER_TRACE"));
+    }
     
-    topFrame = (void**)__builtin_frame_address(0);
-    DEBUG("Stack top is at %p", topFrame);
+    if(Config::get("STABILIZER_REPLAY") != NULL) {
+        loadRecord(Config::get("STABILIZER_REPLAY"));
+        replaying = true;
+        atexit(reportReplay);
+        DEBUG("Replaying %lu epochs from %s", (unsigned long)replay.size(), Config::get("STABILIZER_REPLAY"));
+    }
+    
+    if(prebuild) {
+        pthread_t helper;
+        
+        if(pipe(prebuild_pipe) != 0 || fcntl(prebuild_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+            perror("pipe");
+            ABORT("Couldn't create the relocation helper's wakeup pipe");
+        }
+        
+        if(pthread_create(&helper, NULL, prebuilder, NULL) != 0) {
+            ABORT("Couldn't start the relocation helper thread");
+        }
+        
+        DEBUG("Started the relocation helper thread");
+    }
     
     // Register signal handlers
-    setHandler(Trap::TrapSignal, onTrap);
-    setHandler(SIGALRM, onTimer);
+    if(Trap::TrapSignal != 0) {
+        setHandler(Trap::TrapSignal, onTrap);
+    }
+    setHandler(Timer::getSignal(), onTimer);
+    setHandler(Thread::StopSignal, Thread::onStop);
     setHandler(SIGSEGV, onFault);
+    if(Stats::enabled()) {
+        setHandler(SIGUSR2, onStats);
+    }
     DEBUG("Signal handlers installed");
     
+    if(Config::get("STABILIZER_PROFILE") != NULL) {
+        if(Timer::getSignal() == SIGPROF) {
+            ABORT("STABILIZER_PROFILE uses SIGPROF, so it can't be combined with the prof clock");
+        }
+        
+        setHandler(SIGPROF, onProfile);
+        Profiler::start();
+        atexit(reportProfile);
+        DEBUG("Profiling to %s", Config::get("STABILIZER_PROFILE"));
+    }
+    
     // Lazily relocate functions
-    for(set<Function*>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
-        Function* f = *iter;
-        f->setTrap();
+    for(size_t i=0; i<functions.size(); i++) {
+        functions.setTrap(i);
     }
     DEBUG("Trapped all functions");
     
-    // Set the re-randomization timer
-    setTimer(interval);
-    DEBUG("Set re-randomization timer");
+    if(replaying) {
+        prepareMoves();
+    }
+    
+    // Set the re-randomization timer, unless there is nothing to re-randomize
+    stack_start = getTime();
+    if(randomize_code || randomize_stack) {
+        nextEpoch();
+        DEBUG("Set re-randomization timer");
+    }
     
     // Call all constructors
     for(vector<ctor_t>::iterator i = constructors.begin(); i != constructors.end(); i++) {
@@ -83,37 +461,187 @@ int main(int argc, char **argv) {
     return r;
 }
 
+/**
+ * Take the randomized heap's lock for a program allocation.  The heap has its
+ * own lock, since the runtime never allocates from it, so allocation never
+ * waits on relocation.  A signal handler that allocates while its thread is
+ * already inside the heap must not wait on itself, so it is refused.
+ * \returns False if this thread is already inside the heap
+ */
+bool enterHeap() {
+    if(in_heap) {
+        return false;
+    }
+    
+    // Set first, so a handler that runs while this thread waits is refused too
+    in_heap = true;
+    heap_lock.lock();
+    return true;
+}
+
+/**
+ * Free heap objects that signal handlers freed while this thread was inside
+ * the heap, then release it.  Objects deferred after the list is taken are
+ * freed the next time this thread leaves the heap.
+ */
+void leaveHeap() {
+    void* p = __sync_lock_test_and_set(&deferred_frees, NULL);
+    while(p != NULL) {
+        void* next = *(void**)p;
+        getDataHeap()->free(p);
+        p = next;
+    }
+    
+    heap_lock.unlock();
+    in_heap = false;
+}
+
+/**
+ * Keep the heap consistent across fork, since only the forking thread
+ * continues in the child
+ */
+void lockHeap() {
+    heap_lock.lock();
+}
+
+void unlockHeap() {
+    heap_lock.unlock();
+}
+
 extern "C" {
     void stabilizer_register_function(void* codeBase, void* codeLimit, void* tableBase, size_t tableSize, bool adjacent, uint8_t* stackPad) {
+        // Registering patches the function's header, so functions that won't move are left alone
+        if(!randomize_code) {
+            return;
+        }
+        
+        uint64_t start = getTime();
+        // Pads refilled on their own interval don't follow the function's copies
+        if(!randomize_stack || stack_interval > 0) {
+            stackPad = NULL;
+        }
+        
+        // The function adds itself to the function table
         Function* f = new Function(codeBase, codeLimit, tableBase, tableSize, adjacent, stackPad);
-        functions.insert(f);
+        code_index[(uintptr_t)codeBase] = f;
+        registration_time += getTime() - start;
     }
 
     void stabilizer_register_constructor(ctor_t ctor) {
         constructors.push_back(ctor);
     }
     
-    void stabilizer_register_stack_pad(uint8_t* pad) {
-        stack_pads.insert(pad);
+    /// Set by the timer when an epoch is over, and polled by instrumented code
+    volatile int stabilizer_safepoint_flag = 0;
+    
+    /**
+     * Called by the module constructor of a program built with safepoint polls
+     */
+    void stabilizer_register_safepoints() {
+        safepoints = randomize_code && Config::flag("STABILIZER_SAFEPOINTS", true);
+    }
+    
+    /**
+     * Called by a poll that found stabilizer_safepoint_flag set.  The first
+     * thread to take the runtime lock ends the epoch, and the others park here
+     * until it is done (see Thread::park).  Every thread at a poll is scanned
+     * from this frame up, so nothing is assumed about the caller's frame layout.
+     */
+    void stabilizer_safepoint() {
+        uint64_t start = getTime();
+        uint64_t ticks = Stats::now();
+        Thread* self = Thread::current();
+        
+        // Spill the caller's registers, so the scan from a parked frame sees them
+        __builtin_unwind_init();
+        
+        while(!getRuntimeLock().trylock()) {
+            if(self == NULL || !self->park()) {
+                sched_yield();
+            }
+        }
+        
+        // The epoch may have ended while this thread was parked
+        if(stabilizer_safepoint_flag && !shutting_down) {
+            if(self != NULL) {
+                self->enterSafepoint();
+            }
+            
+            endEpoch(NULL, NULL, NULL, NULL);
+            
+            if(self != NULL) {
+                self->leaveSafepoint();
+            }
+        }
+        
+        getRuntimeLock().unlock();
+        chargeOverhead(start);
+        Stats::add(Stats::Safepoint, ticks);
+    }
+    
+    void stabilizer_register_stack_pads(uint8_t* base, size_t count) {
+        stack_pad_tables.push_back(MemRange(base, count));
+        
+        if(randomize_stack) {
+            Random::get(Random::PadStream).fill(base, count);
+        }
+    }
+
+    int stabilizer_pthread_create(pthread_t* thread, const pthread_attr_t* attr, void*(*fn)(void*), void* arg) {
+        return Thread::create(thread, attr, fn, arg);
     }
 
     void* stabilizer_malloc(size_t sz) {
-        return getDataHeap()->malloc(sz);
+        if(!enterHeap()) {
+            return malloc(sz);
+        }
+        void* p = getDataHeap()->malloc(sz);
+        leaveHeap();
+        return p;
     }
     
     void* stabilizer_calloc(size_t n, size_t sz) {
-        return getDataHeap()->calloc(n, sz);
+        if(!enterHeap()) {
+            return calloc(n, sz);
+        }
+        void* p = getDataHeap()->calloc(n, sz);
+        leaveHeap();
+        return p;
     }
 
     void* stabilizer_realloc(void *p, size_t sz) {
-        return getDataHeap()->realloc(p, sz);
+        if(!enterHeap()) {
+            // Move a heap object to the system heap, and free it once the heap is released
+            size_t old = p != NULL ? getDataHeap()->getSize(p) : 0;
+            if(old == 0) {
+                return realloc(p, sz);
+            }
+            void* q = malloc(sz);
+            if(q != NULL) {
+                memcpy(q, p, old < sz ? old : sz);
+                *(void**)p = deferred_frees;
+                deferred_frees = p;
+            }
+            return q;
+        }
+        void* q = getDataHeap()->realloc(p, sz);
+        leaveHeap();
+        return q;
     }
 
     void stabilizer_free(void *p) {
+        if(p == NULL) {
+            return;
+        }
+        
         if(getDataHeap()->getSize(p) == 0) {
             free(p);
+        } else if(!enterHeap()) {
+            *(void**)p = deferred_frees;
+            deferred_frees = p;
         } else {
             getDataHeap()->free(p);
+            leaveHeap();
         }
     }
 
@@ -123,101 +651,1157 @@ extern "C" {
 }
 
 void onTrap(int sig, siginfo_t* info, void* p) {
+    uint64_t start = getTime();
+    uint64_t ticks = Stats::now();
     Context c(p);
 
     // Back up over the trap instruction
     c.ip() = (void*)((uintptr_t)c.ip() - Trap::TrapAdjust);
+    
+    c.ip() = trapped(c.ip(), c.sp(), c.fp());
+    chargeOverhead(start);
+    Stats::add(Stats::Trap, ticks);
+}
+
+/**
+ * Entry point for traps that call into the runtime through stabilizer_trap_stub
+ * instead of raising a signal.
+ * 
+ * \arg slot The stub's return slot, which points just past the trap instruction
+ * \arg sp The stack pointer on entry to the trapped function
+ * \arg fp The frame pointer on entry to the trapped function
+ */
+void stabilizer_trap_entry(void** slot, void* sp, void* fp) {
+    uint64_t start = getTime();
+    uint64_t ticks = Stats::now();
+    void* ip = (void*)((uintptr_t)*slot - Trap::TrapAdjust);
+    
+    // The stub returns through this slot into the relocated function
+    *slot = trapped(ip, sp, fp);
+    chargeOverhead(start);
+    Stats::add(Stats::Trap, ticks);
+}
 
+/**
+ * Relocate a function that hit its trap, and run a pending re-randomization.
+ * 
+ * \arg ip The address of the trapped function header
+ * \arg sp The stack pointer on entry to the trapped function
+ * \arg fp The frame pointer on entry to the trapped function
+ * \returns The address execution should continue at
+ */
+void* trapped(void* ip, void* sp, void* fp) {
     // Extract the trapped function (stored next to the trap instruction)
-    FunctionHeader* h = (FunctionHeader*)c.ip();
+    FunctionHeader* h = (FunctionHeader*)ip;
     Function* f = h->getFunction();
     
+    getRuntimeLock().lock();
+    
+    // Another thread may have relocated the function while this one waited
+    if(!f->isTrapped()) {
+        void* target = f->getCurrentLocation()->getBase();
+        getRuntimeLock().unlock();
+        return target;
+    }
+    
+    // A replayed epoch that ended before this trap in the recorded run must end now
+    while(replaying && replayDue(true)) {
+        DEBUG("Ending replayed epoch at trap %llu", (unsigned long long)traps);
+        endEpoch(NULL, ip, sp, fp);
+    }
+    traps++;
+    
     // If the trap was placed to trigger a re-randomization
     if(rerandomizing) {
-        DEBUG("Re-randomization started after trap on %p", c.ip());
-        live_functions.empty();
-        
-        // Mark all on-stack function locations as used
-        Stack s = c.stack();
-        while(s.fp() != topFrame) {
-            FunctionLocation::mark(s.ret());
-            s++;
-        }
-        
-        // Mark the current instruction pointer as used
-        FunctionLocation::mark((void*)c.ip());
+        DEBUG("Re-randomization started after trap on %p", ip);
+        uint64_t start = getTime();
         
-        // Mark the top return address on the stack as used
-        FunctionLocation::mark(*(void**)c.sp());
+        // Mark all function locations in use by any thread
+        Thread::stopAll();
+        markStack(ip, sp, fp);
+        scanThreads();
+        Thread::resumeAll();
         
         // Collect unused function locations
         FunctionLocation::sweep();
         
+        DEBUG("Re-randomization paused for %lu us, %lu function locations remain in %lu code regions",
+            (unsigned long)(getTime() - start), (unsigned long)FunctionLocation::count(),
+            (unsigned long)CodeRegion::count());
+        
         rerandomizing = false;
-        setTimer(interval);
+        nextEpoch();
     }
 
     // Relocate the function
+    noteMove(f);
     FunctionLocation* oldLocation = f->relocate();
-    live_functions.insert(f);
+    functions.live().set(f->getId());
+    
+    // Other threads may be calling the function, so only patch it in place if
+    // that can be done with one store
+    if(f->canActivateAtomically()) {
+        f->activate();
+    } else {
+        Thread::stopAll();
+        restartThreads(f);
+        f->activate();
+        Thread::resumeAll();
+    }
     
     if(oldLocation != NULL) {
         oldLocation->release();
     }
-
-    c.ip() = f->getCurrentLocation()->getBase();
+    
+    void* target = f->getCurrentLocation()->getBase();
+    getRuntimeLock().unlock();
+    
+    return target;
 }
 
 void onTimer(int sig, siginfo_t* info, void* p) {
+    if(shutting_down) {
+        return;
+    }
+    
+    uint64_t start = getTime();
+    uint64_t ticks = Stats::now();
     Context c(p);
+    
+    // Between epoch boundaries the timer only samples the running function
+    if(cold_period > 0 && ++epoch_ticks < SamplesPerEpoch) {
+        if(getRuntimeLock().trylock()) {
+            sample(c.ip());
+            getRuntimeLock().unlock();
+        }
+        
+        setTimer(max(interval / SamplesPerEpoch, (size_t)1));
+        chargeOverhead(start);
+        Stats::add(Stats::Tick, ticks);
+        return;
+    }
+
+    // When replaying, the timer polls for the next recorded boundary
+    if(replaying && !replayDue(false)) {
+        setTimer(1);
+        chargeOverhead(start);
+        Stats::add(Stats::Tick, ticks);
+        return;
+    }
 
+    // The epoch ends at the next poll, where every thread that polls can stop itself
+    if(safepoints) {
+        stabilizer_safepoint_flag = 1;
+        chargeOverhead(start);
+        Stats::add(Stats::Tick, ticks);
+        return;
+    }
+    
+    // Don't touch runtime state while any thread is changing it; try again
+    // shortly.  Stub traps relocate outside any signal handler, so the timer
+    // may have interrupted this thread in the runtime, even while it was
+    // writing debug output.  Nothing before this point may do either.
+    if(!getRuntimeLock().trylock()) {
+        setTimer(1);
+        chargeOverhead(start);
+        Stats::add(Stats::Tick, ticks);
+        return;
+    }
+    
     DEBUG("Re-randomization timer fired at %p", c.ip());
     
-    if(functions.size() == 0) {
+    if(cold_period > 0) {
+        sample(c.ip());
+    }
+    
+    endEpoch(p, c.ip(), c.sp(), c.fp());
+    
+    getRuntimeLock().unlock();
+    chargeOverhead(start);
+    Stats::add(Stats::Tick, ticks);
+}
+
+/**
+ * End the current epoch: relocate live functions (eager) or trap them so they
+ * move on their next call (lazy).  Must be called with the runtime lock held.
+ * 
+ * \arg context The signal context of the calling thread, or NULL when the
+ * epoch ends at a trap, where the thread is at the header of a function that
+ * is not live, or at a safepoint
+ * \arg ip The calling thread's instruction pointer, or NULL at a safepoint,
+ * where the calling thread's stack is published with Thread::enterSafepoint()
+ * \arg sp The calling thread's stack pointer
+ * \arg fp The calling thread's frame pointer
+ */
+void endEpoch(void* context, void* ip, void* sp, void* fp) {
+    uint64_t ticks = Stats::now();
+    bool atSafepoint = context == NULL && ip == NULL;
+    recordEpoch();
+    Trace::epoch();
+    PerfMap::flush();
+    Profiler::epoch();
+    recordCounters();
+    
+    bool relocating = functions.size() > 0;
+    
+    // Without relocation, or on their own interval, stack pads are refilled in place
+    uint64_t now = getTime();
+    if(stack_interval > 0 ? now - stack_start >= stack_interval * 1000 : !relocating) {
         DEBUG("Re-randomizing stack pads");
-        for(set<uint8_t*>::iterator iter = stack_pads.begin(); iter != stack_pads.end(); iter++) {
-            uint8_t* pad = *iter;
-			**iter = getRandomByte();
+        randomizeStackPads();
+        stack_start = now;
+    }
+    
+    if(!relocating) {
+        nextEpoch();
+        
+    } else if(eager) {
+        DEBUG("Relocating %lu live functions", (unsigned long)functions.live().count());
+        uint64_t start = getTime();
+        
+        // Copies made in this epoch go to a fresh code region
+        rotateRegions();
+        
+        if(replaying) {
+            prepareMoves();
         }
         
-        setTimer(interval);
+        FunctionBits& live = functions.live();
+        
+        // Copy every function that has been called while other threads keep running
+        for(size_t i = live.next(0); i != FunctionBits::End; i = live.next(i + 1)) {
+            Function* f = functions[i];
+            
+            if(!moveThisEpoch(f)) {
+                continue;
+            }
+            
+            noteMove(f);
+            FunctionLocation* oldLocation = f->relocate();
+            
+            if(oldLocation != NULL) {
+                oldLocation->release();
+            }
+        }
+        
+        Thread::stopAll(atSafepoint ? safepoint_wait : 0);
+        
+        // Threads released from their polls must not find the epoch still ending
+        if(atSafepoint) {
+            stabilizer_safepoint_flag = 0;
+        }
+        
+        // Redirect calls to the new copies.  Functions left in place have been idle for an epoch.
+        for(size_t i = live.next(0); i != FunctionBits::End; i = live.next(i + 1)) {
+            Function* f = functions[i];
+            
+            if(f->getIdleEpochs() > 0) {
+                continue;
+            }
+            
+            if(context != NULL) {
+                Context c(context);
+                f->restartHeader(c);
+            }
+            restartThreads(f);
+            f->activate();
+        }
+        
+        // The timer may have interrupted library code without frame pointers,
+        // so scan this thread conservatively, like the stopped threads.  A
+        // trap stops at a function header, where frames can be walked.  At a
+        // safepoint this thread is scanned with the parked threads.
+        Thread* self = Thread::current();
+        if(self != NULL) {
+            if(context != NULL) {
+                scanStack(context, self->getTop());
+            } else if(!atSafepoint) {
+                markStack(ip, sp, fp);
+            }
+        }
+        scanThreads();
+        
+        Thread::resumeAll();
+        
+        // Old locations are only reclaimed once no frame returns into them.
+        // Without a registered stack to scan, wait for a later epoch.
+        if(self != NULL) {
+            FunctionLocation::sweep();
+        }
+        
+        DEBUG("Re-randomization paused for %lu us, %lu function locations remain in %lu code regions",
+            (unsigned long)(getTime() - start), (unsigned long)FunctionLocation::count(),
+            (unsigned long)CodeRegion::count());
+        
+        // Functions are never re-trapped, so no trap will restart the timer
+        nextEpoch();
+        
+        // Every live function stays hot in eager mode
+        wakePrebuilder();
         
     } else {
         DEBUG("Placing traps");
-        for(set<Function*>::iterator iter = live_functions.begin(); iter != live_functions.end(); iter++) {
-            Function* f = *iter;
-            if(c.ip() == f->getCodeBase()) {
-                DEBUG("Forwarding from trap at %p", c.ip());
-                c.ip() = f->getCurrentLocation()->getBase();
+        rotateRegions();
+        
+        if(replaying) {
+            prepareMoves();
+        }
+        Thread::stopAll();
+        void* forwarded = NULL;
+        
+        // The functions trapped now are likely to be called again next epoch
+        FunctionBits& live = functions.live();
+        FunctionBits& hot = functions.hot();
+        hot.clear();
+        
+        for(size_t i = live.next(0); i != FunctionBits::End; i = live.next(i + 1)) {
+            Function* f = functions[i];
+            
+            if(!moveThisEpoch(f)) {
+                continue;
+            }
+            
+            // Traps may cover more than the first instruction of the header
+            if(context != NULL) {
+                Context c(context);
+                f->restartHeader(c);
+                
+                if(c.ip() == f->getCodeBase()) {
+                    forwarded = c.ip();
+                    c.ip() = f->getCurrentLocation()->getBase();
+                }
             }
-            f->setTrap();
+            restartThreads(f);
+            functions.setTrap(i);
+            f->retire();
+            
+            hot.set(i);
+            live.clear(i);
+        }
+        
+        Thread::resumeAll();
+        wakePrebuilder();
+        
+        // Logged only once the other threads run, since one may hold the stderr lock
+        if(forwarded != NULL) {
+            DEBUG("Forwarding from trap at %p", forwarded);
         }
         
-        live_functions.clear();
+        // Functions left in place don't trap, so if none moved start the next epoch now
+        if(hot.empty()) {
+            nextEpoch();
+        } else {
+            rerandomizing = true;
+        }
     }
     
-    rerandomizing = true;
+    Stats::add(Stats::EpochEnd, ticks);
 }
 
-void onFault(int sig, siginfo_t* info, void* p) {
-    Context c(p);
-    ABORT("Fault at %p, accessing address %p", c.ip(), info->si_addr);
+/**
+ * Mark every function location referenced by the calling thread's interrupted
+ * context as in use: all return addresses on the stack, the interrupted
+ * instruction, and the top stack slot (which holds the return address if the
+ * frame isn't set up yet).
+ * 
+ * \arg ip The interrupted instruction pointer
+ * \arg sp The interrupted stack pointer
+ * \arg fp The interrupted frame pointer
+ */
+void markStack(void* ip, void* sp, void* fp) {
+    uint64_t ticks = Stats::now();
+    Thread* t = Thread::current();
+    void** top = t != NULL ? t->getTop() : NULL;
+    
+    if(retarget) {
+        retargetStack(sp, fp, top);
+    }
+    
+    Stack s(fp);
+    while(s.fp() != top) {
+        FunctionLocation::mark(s.ret());
+        s++;
+    }
+    
+    FunctionLocation::mark(ip);
+    FunctionLocation::mark(*(void**)sp);
+    Stats::add(Stats::StackWalk, ticks);
 }
 
-void setTimer(int msec) {
-    struct itimerval timer;
-
-    timer.it_value.tv_sec = (msec - msec % 1000) / 1000;
-    timer.it_value.tv_usec = 1000 * (msec % 1000);
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
+/**
+ * Conservatively mark every function location referenced by an interrupted
+ * context's saved registers or stack.  Unlike markStack, this does not depend
+ * on frame pointers, so the context may be stopped anywhere.
+ * 
+ * \arg context The signal context
+ * \arg top The top of the interrupted thread's stack
+ */
+void scanStack(void* context, void** top) {
+    uint64_t ticks = Stats::now();
+    Context c(context);
+    
+    // Frames can only be walked if the thread stopped in code with frame pointers
+    if(retarget && FunctionLocation::functionAt(c.ip()) != NULL) {
+        retargetStack(c.sp(), c.fp(), top);
+    }
+    
+    void** regs = (void**)context;
+    for(size_t i=0; i<sizeof(ucontext_t)/sizeof(void*); i++) {
+        FunctionLocation::mark(regs[i]);
+    }
     
-    setitimer(ITIMER_REAL, &timer, 0);
+    for(void** p = (void**)c.sp(); p < top; p++) {
+        FunctionLocation::mark(*p);
+    }
+    Stats::add(Stats::StackWalk, ticks);
+}
+
+/**
+ * Conservatively mark every function location referenced by the stack of a
+ * thread parked at a poll.  Parked stacks are not retargeted, since the poll's
+ * caller may not keep frame pointers.
+ * 
+ * \arg bottom The lowest slot that may hold a program value
+ * \arg top The top of the parked thread's stack
+ */
+void scanParkedStack(void** bottom, void** top) {
+    uint64_t ticks = Stats::now();
+    
+    for(void** p = bottom; p < top; p++) {
+        FunctionLocation::mark(*p);
+    }
+    Stats::add(Stats::StackWalk, ticks);
+}
+
+/**
+ * Move the return addresses in a thread's frame chain out of defunct copies
+ * (see FunctionLocation::retarget), so marking doesn't find them there.  The
+ * walk stops at the first frame pointer that doesn't lead further up the
+ * stack, and only slots holding an address in relocated code are rewritten,
+ * so code without frame pointers ends the walk rather than being corrupted.
+ * Copies referenced some other way are still marked as usual.
+ * 
+ * \arg sp The thread's stack pointer
+ * \arg fp The thread's frame pointer
+ * \arg top The top of the thread's stack
+ */
+void retargetStack(void* sp, void* fp, void** top) {
+    void** frame = (void**)fp;
+    
+    while(frame >= (void**)sp && frame + 1 < top) {
+        Stack s(frame);
+        s.ret() = FunctionLocation::retarget(s.ret());
+        
+        if((void**)s.fp() <= frame) {
+            break;
+        }
+        frame = (void**)s.fp();
+    }
+}
+
+/**
+ * Mark every function location referenced by a stopped or parked thread.
+ */
+void scanThreads() {
+    for(set<Thread*>::iterator iter = Thread::all().begin(); iter != Thread::all().end(); iter++) {
+        Thread* t = *iter;
+        
+        if(t->isStopped()) {
+            scanStack(t->getContextBase(), t->getTop());
+        } else if(t->isParked()) {
+            scanParkedStack(t->getParkedStack(), t->getTop());
+        }
+    }
+}
+
+/**
+ * Restart any stopped thread that is partway through a function's header.
+ * \arg f The function whose header will be rewritten
+ */
+void restartThreads(Function* f) {
+    for(set<Thread*>::iterator iter = Thread::all().begin(); iter != Thread::all().end(); iter++) {
+        Thread* t = *iter;
+        
+        if(t->isStopped()) {
+            f->restartHeader(t->getContext());
+        }
+    }
+}
+
+void onFault(int sig, siginfo_t* info, void* p) {
+    Context c(p);
+    ABORT("Fault at %p, accessing address %p", c.ip(), info->si_addr);
+}
+
+void setTimer(int msec) {
+    Timer::set(msec);
+}
+
+/**
+ * Start a new epoch and set the timer for its end.  With an overhead budget,
+ * the interval is scaled by the ratio of the last epoch's measured overhead
+ * to the budget.  Each step is limited to a factor of two so one noisy epoch
+ * can't swing the interval, and the interval stays within
+ * [min_interval, max_interval].  Must be called with the runtime lock held.
+ */
+void nextEpoch() {
+    uint64_t now = getTime();
+    
+    if(budget > 0 && epoch_start != 0 && now > epoch_start) {
+        double overhead = (double)epoch_overhead / (now - epoch_start);
+        double scale = overhead / budget;
+        
+        if(scale < 0.5) {
+            scale = 0.5;
+        } else if(scale > 2) {
+            scale = 2;
+        }
+        
+        interval = (size_t)(interval * scale);
+        
+        if(interval < min_interval) {
+            interval = min_interval;
+        } else if(interval > max_interval) {
+            interval = max_interval;
+        }
+        
+        DEBUG("Epoch overhead was %.2f%%, next interval is %lu ms", overhead * 100, (unsigned long)interval);
+    }
+    
+    if(budget > 0) {
+        intervals.push_back(interval);
+    }
+    
+    epoch_start = now;
+    epoch_overhead = 0;
+    
+    if(replaying) {
+        // Poll for the next recorded boundary, if there is one
+        if(replay_next < replay.size()) {
+            setTimer(1);
+        }
+    } else if(cold_period > 0) {
+        epoch_ticks = 0;
+        setTimer(max(interval / SamplesPerEpoch, (size_t)1));
+    } else {
+        setTimer(interval);
+    }
+}
+
+/**
+ * Add the time since start to the current epoch's runtime overhead
+ */
+void chargeOverhead(uint64_t start) {
+    uint64_t elapsed = getTime() - start;
+    __sync_fetch_and_add(&epoch_overhead, elapsed);
+    __sync_fetch_and_add(&total_overhead, elapsed);
+}
+
+/**
+ * Report the interval used for every epoch so an adaptive run can be reproduced
+ */
+void logIntervals() {
+    getRuntimeLock().lock();
+    
+    fprintf(stderr, "stabilizer: %lu epochs with a %.2f%% overhead budget, intervals (ms):",
+        (unsigned long)intervals.size(), budget * 100);
+    
+    for(list<size_t, PoolAllocator<size_t> >::iterator iter = intervals.begin(); iter != intervals.end(); iter++) {
+        fprintf(stderr, " %lu", (unsigned long)*iter);
+    }
+    fprintf(stderr, "\n");
+    
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Stop re-randomizing at exit.  Static destructors may tear down the thread
+ * and function sets, so a timer that fires afterward must not touch them.
+ */
+void shutdown() {
+    getRuntimeLock().lock();
+    shutting_down = true;
+    setTimer(0);
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Credit a timer sample to the function whose copy was running.  Samples in
+ * original code, libraries, or the runtime are not counted.  Must be called
+ * with the runtime lock held.
+ */
+void sample(void* ip) {
+    Function* f = FunctionLocation::functionAt(ip);
+    if(f != NULL) {
+        f->sampled();
+    }
+}
+
+/**
+ * Write the runtime statistics on request
+ */
+void onStats(int sig, siginfo_t* info, void* p) {
+    Stats::report();
+}
+
+/**
+ * Take a profiling sample.  The call chain is walked by frame pointers, so
+ * the caller of a function without a frame is missing from the chain.  Samples are dropped while the
+ * runtime lock is held, since function locations may be changing.
+ */
+void onProfile(int sig, siginfo_t* info, void* p) {
+    if(shutting_down) {
+        return;
+    }
+    
+    if(!getRuntimeLock().trylock()) {
+        Profiler::busy();
+        return;
+    }
+    
+    Context c(p);
+    void* chain[Profiler::MaxDepth];
+    size_t depth = 0;
+    
+    chain[depth++] = originalFunction(c.ip());
+    
+    // Only registered threads have a known stack top to stop the walk at
+    Thread* t = Thread::current();
+    if(t != NULL) {
+        void** frame = (void**)c.fp();
+        
+        while(depth < Profiler::MaxDepth && frame >= (void**)c.sp() && frame < t->getTop() && (uintptr_t)frame % sizeof(void*) == 0) {
+            // Look up the call instruction, which may be the last in its function
+            chain[depth++] = originalFunction((void*)((uintptr_t)frame[1] - 1));
+            
+            if((void**)frame[0] <= frame) {
+                break;
+            }
+            frame = (void**)frame[0];
+        }
+    }
+    
+    Profiler::record(chain, depth);
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Find the original function containing an address.  Relocated addresses are
+ * mapped back to the original code first.  Must be called with the runtime
+ * lock held.
+ * \returns The original base of a registered function, or the address itself
+ * (in its original code) if it is in no registered function
+ */
+void* originalFunction(void* p) {
+    p = FunctionLocation::adjust(p);
+    
+    map<uintptr_t, Function*>::iterator iter = code_index.upper_bound((uintptr_t)p);
+    if(iter == code_index.begin()) {
+        return p;
+    }
+    
+    iter--;
+    
+    Function* f = iter->second;
+    if((uintptr_t)p - (uintptr_t)f->getCodeBase() < f->getCodeSize()) {
+        return f->getCodeBase();
+    }
+    
+    return p;
+}
+
+/**
+ * Name a function in the profile.  Registered functions get the same names
+ * as in the perf map.  Other code is named by its nearest dynamic symbol, or
+ * by its module.
+ */
+const char* profileName(void* f) {
+    if(code_index.count((uintptr_t)f) > 0) {
+        return PerfMap::resolve(f);
+    }
+    
+    Dl_info info;
+    if(!dladdr(f, &info) || info.dli_fname == NULL) {
+        return "[unknown]";
+    } else if(info.dli_sname != NULL) {
+        return info.dli_sname;
+    } else {
+        return info.dli_fname;
+    }
+}
+
+/**
+ * Write the profile at exit
+ */
+void reportProfile() {
+    Profiler::stop();
+    
+    getRuntimeLock().lock();
+    
+    FILE* f = fopen(Config::get("STABILIZER_PROFILE"), "w");
+    if(f == NULL) {
+        perror("fopen");
+    } else {
+        Profiler::report(f, profileName);
+        fclose(f);
+    }
+    
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Open the per-epoch counters and their output file, and write the header
+ * row.  Hardware events the kernel or virtual machine doesn't expose are left
+ * out.  If none are available, software events stand in, so epochs can still
+ * be compared by time and paging.
+ * \arg path The file to write counts to
+ */
+void openCounters(const char* path) {
+    counters = new PerfCounterGroup();
+    
+#if IS_LINUX
+    counters->add(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles");
+    counters->add(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions");
+    counters->add(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "l1i_misses");
+    counters->add(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "itlb_misses");
+    counters->add(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses");
+    counters->add(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses");
+    
+    if(counters->size() == 0) {
+        counters->add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task_clock_ns");
+        counters->add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches");
+        counters->add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu_migrations");
+        counters->add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults");
+    }
+#endif
+    
+    if(counters->size() == 0) {
+        ABORT("No performance counters are available for STABILIZER_COUNTERS");
+    }
+    
+    counters_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(counters_fd == -1) {
+        perror("open");
+        ABORT("Couldn't open the counter file %s", path);
+    }
+    
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "# epoch us");
+    for(size_t i=0; i<counters->size() && n < (int)sizeof(buf); i++) {
+        n += snprintf(&buf[n], sizeof(buf) - n, " %s", counters->getName(i));
+    }
+    if(n < (int)sizeof(buf)) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "\n");
+    }
+    if(n >= (int)sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+    
+    if(write(counters_fd, buf, n) != n) {
+        perror("write");
+    }
+    
+    Thread::countEvents(counters);
+    Thread::readEvents(counters_last);
+    counters_time = getTime();
+}
+
+/**
+ * Write one row for the epoch that is ending: its number, its length in
+ * microseconds, and the events counted during it by all threads.  Each
+ * thread's group is read in one call, so its counts cover the same
+ * instructions.  Uses only snprintf and system calls, since epochs end in
+ * signal handlers.  Must be called with the runtime lock held.
+ */
+void recordCounters() {
+    if(counters == NULL) {
+        return;
+    }
+    
+    uint64_t values[PerfCounterGroup::MaxEvents];
+    uint64_t now = getTime();
+    
+    Thread::readEvents(values);
+    
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%lu %llu", (unsigned long)counters_epoch,
+        (unsigned long long)(now - counters_time));
+    
+    for(size_t i=0; i<counters->size() && n < (int)sizeof(buf); i++) {
+        // Scaling a multiplexed group can make a count dip below the last one
+        uint64_t delta = values[i] > counters_last[i] ? values[i] - counters_last[i] : 0;
+        n += snprintf(&buf[n], sizeof(buf) - n, " %llu", (unsigned long long)delta);
+        counters_last[i] = values[i];
+    }
+    
+    if(n < (int)sizeof(buf)) {
+        n += snprintf(&buf[n], sizeof(buf) - n, "\n");
+    }
+    
+    if(n >= (int)sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+    
+    if(write(counters_fd, buf, n) != n) {
+        perror("write");
+    }
+    
+    counters_time = now;
+    counters_epoch++;
+}
+
+/**
+ * Write the counts for the final, partial epoch at exit
+ */
+void reportCounters() {
+    getRuntimeLock().lock();
+    recordCounters();
+    close(counters_fd);
+    counters = NULL;
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Decide whether a live function moves at this epoch boundary, and age its
+ * heat.  Every function moves if hotness isn't sampled.  Otherwise hot
+ * functions move every epoch and cold functions every cold_period epochs, so
+ * the whole program is still re-randomized regularly.  Must be called once
+ * per live function per epoch, with the runtime lock held.
+ */
+bool moveThisEpoch(Function* f) {
+    bool move = cold_period == 0 || f->isHot() || f->getIdleEpochs() + 1 >= cold_period;
+    
+    if(!move) {
+        f->stay();
+    }
+    
+    f->cool();
+    return move;
+}
+
+bool compareRelocations(Function* a, Function* b) {
+    return a->getRelocations() > b->getRelocations();
+}
+
+/**
+ * Report how many times each relocated function moved and how often it was
+ * sampled, most relocated first
+ */
+void reportRelocations() {
+    getRuntimeLock().lock();
+    
+    vector<Function*> moved;
+    size_t total = 0;
+    for(size_t i=0; i<functions.size(); i++) {
+        Function* f = functions[i];
+        
+        if(f->getRelocations() > 0) {
+            moved.push_back(f);
+            total += f->getRelocations();
+        }
+    }
+    
+    sort(moved.begin(), moved.end(), compareRelocations);
+    
+    fprintf(stderr, "stabilizer: %lu relocations of %lu functions, moving unsampled functions every %lu epochs\n",
+        (unsigned long)total, (unsigned long)moved.size(), (unsigned long)cold_period);
+    fprintf(stderr, "stabilizer: %12s %12s  %s\n", "relocations", "samples", "function");
+    
+    for(vector<Function*>::iterator iter = moved.begin(); iter != moved.end(); iter++) {
+        Function* f = *iter;
+        
+        Dl_info info;
+        if(dladdr(f->getCodeBase(), &info) && info.dli_sname != NULL) {
+            fprintf(stderr, "stabilizer: %12lu %12lu  %s\n",
+                (unsigned long)f->getRelocations(), (unsigned long)f->getSamples(), info.dli_sname);
+        } else {
+            fprintf(stderr, "stabilizer: %12lu %12lu  %p\n",
+                (unsigned long)f->getRelocations(), (unsigned long)f->getSamples(), f->getCodeBase());
+        }
+    }
+    
+    getRuntimeLock().unlock();
+}
+
+/**
+ * Refill every module's stack pad table with random bytes.  Tables are whole
+ * cache lines, so this is one sequential fill per module.
+ */
+void randomizeStackPads() {
+    if(!randomize_stack) {
+        return;
+    }
+    
+    for(vector<MemRange>::iterator iter = stack_pad_tables.begin(); iter != stack_pad_tables.end(); iter++) {
+        Random::get(Random::PadStream).fill(iter->base(), iter->size());
+    }
+}
+
+/**
+ * Seed the random streams before any program constructor allocates or
+ * registers stack pads.  Replay takes the seed from the first line of the
+ * record.  STABILIZER_SEED sets one explicitly.  Otherwise streams seed
+ * themselves from the kernel.
+ */
+__attribute__((constructor(101))) void seedRandom() {
+    unsigned long long s;
+    
+    if(Config::get("STABILIZER_REPLAY") != NULL) {
+        FILE* f = fopen(Config::get("STABILIZER_REPLAY"), "r");
+        if(f == NULL || fscanf(f, "seed %llx", &s) != 1) {
+            ABORT("Couldn't read a seed from the layout record %s", Config::get("STABILIZER_REPLAY"));
+        }
+        fclose(f);
+        Random::seed(s);
+        
+    } else if(Config::get("STABILIZER_SEED") != NULL) {
+        Random::seed(strtoull(Config::get("STABILIZER_SEED"), NULL, 0));
+    }
+}
+
+/**
+ * Read the epoch boundaries and moves of a recorded run.  Functions must
+ * already be registered, since moves name them by ID.
+ */
+void loadRecord(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        perror("fopen");
+        ABORT("Couldn't open the layout record %s", path);
+    }
+    
+    unsigned long long seed;
+    char mode[16];
+    if(fscanf(f, "seed %llx mode %15s", &seed, mode) != 2) {
+        ABORT("Malformed layout record %s", path);
+    }
+    
+    if(strcmp(mode, eager ? "eager" : "lazy") != 0) {
+        ABORT("The layout record %s was made with %s relocation", path, mode);
+    }
+    
+    char kind[16];
+    while(fscanf(f, " %15s", kind) == 1) {
+        unsigned long long t, i, us;
+        unsigned long id;
+        
+        if(strcmp(kind, "epoch") == 0 && fscanf(f, "%llu %llu %llu", &t, &i, &us) == 3) {
+            EpochRecord r = { t, i, us, replay_moves.size() };
+            replay.push_back(r);
+            
+        } else if(strcmp(kind, "move") == 0 && fscanf(f, "%lu", &id) == 1 && id < functions.size()) {
+            replay_moves.push_back(id);
+            
+        } else {
+            ABORT("Malformed layout record %s, or it was made with a different program", path);
+        }
+    }
+    
+    fclose(f);
+}
+
+/**
+ * Log the position of an epoch boundary when recording, and advance to the
+ * next boundary when replaying.  Must be called with the runtime lock held.
+ */
+void recordEpoch() {
+    if(record_fd != -1) {
+        char buf[96];
+        int n = snprintf(buf, sizeof(buf), "epoch %llu %llu %llu\n",
+            (unsigned long long)traps, (unsigned long long)instructions->read(),
+            (unsigned long long)(getTime() - run_start));
+        
+        if(write(record_fd, buf, n) != n) {
+            // The record is incomplete, but the run goes on
+        }
+    }
+    
+    if(replaying) {
+        replay_next++;
+    }
+}
+
+/**
+ * Check if the next recorded epoch boundary has been reached.  Placements
+ * only change at traps and boundaries, so a boundary is replayed exactly by
+ * putting it between the same two traps.  Within that window it waits for
+ * the recorded instruction count (or time, without an instruction counter),
+ * so each layout runs for about as long as it did in the recorded run.
+ * 
+ * \arg atTrap If true, the caller is about to handle another trap, so a
+ * boundary recorded before it is due however far the run has gotten
+ */
+bool replayDue(bool atTrap) {
+    if(replay_next >= replay.size()) {
+        return false;
+    }
+    
+    EpochRecord& r = replay[replay_next];
+    
+    if(traps != r.traps) {
+        return false;
+    } else if(atTrap) {
+        return true;
+    } else if(instructions->isAvailable() && r.instructions != 0) {
+        return instructions->read() >= r.instructions;
+    } else {
+        return getTime() - run_start >= r.time;
+    }
+}
+
+/**
+ * Report whether every recorded epoch was replayed.  A run that stops short
+ * or keeps trapping past the last boundary has diverged from the record.
+ */
+void reportReplay() {
+    fprintf(stderr, "stabilizer: replayed %lu of %lu epochs with seed %llx, %lu moves were not in the record\n",
+        (unsigned long)replay_next, (unsigned long)replay.size(), (unsigned long long)Random::getSeed(),
+        (unsigned long)replay_misses);
+}
+
+/**
+ * Note that a function is about to move.  Recording logs the move, so a
+ * replay can make the same copies in the same order.  A replayed move with
+ * no copy prepared for it means the run has diverged from the record.
+ * Must be called with the runtime lock held.
+ */
+void noteMove(Function* f) {
+    if(record_fd != -1) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "move %lu\n", (unsigned long)f->getId());
+        
+        if(write(record_fd, buf, n) != n) {
+            // The record is incomplete, but the run goes on
+        }
+    }
+    
+    if(replaying && !f->hasSpare()) {
+        replay_misses++;
+    }
+}
+
+/**
+ * Copy the functions the recorded run moved in the epoch that is starting,
+ * in the order it moved them.  Traps may arrive in a different order in the
+ * replay, but each function then finds the same copy waiting for it.  Must be
+ * called with the runtime lock held, once the epoch's region is current.
+ */
+void prepareMoves() {
+    size_t begin = replay_next == 0 ? 0 : replay[replay_next - 1].moves;
+    size_t end = replay_next < replay.size() ? replay[replay_next].moves : replay_moves.size();
+    
+    for(size_t i=begin; i<end; i++) {
+        functions[replay_moves[i]]->prepare(CodeRegion::current());
+    }
+}
+
+/**
+ * Make a new code region current at an epoch boundary.  Spare copies that
+ * were left unused in the closing region are dropped so they don't hold it.
+ * Must be called with the runtime lock held.
+ */
+void rotateRegions() {
+    if(prebuild || replaying) {
+        CodeRegion* closing = CodeRegion::current();
+        
+        for(size_t i=0; i<functions.size(); i++) {
+            functions[i]->dropSpare(closing);
+        }
+    }
+    
+    CodeRegion::next();
+}
+
+/**
+ * Ask the helper thread to build spares for the hot functions.  Safe to call
+ * from signal handlers.  Extra wakeups are dropped if the pipe is full.
+ */
+void wakePrebuilder() {
+    if(prebuild) {
+        char c = 0;
+        if(write(prebuild_pipe[1], &c, 1) != 1) {
+            // The helper already has a wakeup pending
+        }
+    }
+}
+
+/**
+ * The relocation helper thread.  At the start of each epoch it copies every
+ * hot function into the upcoming code region, so the next relocation of each
+ * function just switches to its spare.  Copies are built one at a time so
+ * program threads never wait long for the runtime lock.
+ */
+void* prebuilder(void*) {
+    // Leave timer and stop signals to the program's threads
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, Timer::getSignal());
+    sigaddset(&mask, Thread::StopSignal);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+    vector<Function*> pending;
+    char buf[64];
+    
+    while(read(prebuild_pipe[0], buf, sizeof(buf)) > 0) {
+        getRuntimeLock().lock();
+        
+        if(shutting_down) {
+            getRuntimeLock().unlock();
+            break;
+        }
+        
+        FunctionBits& hot = eager ? functions.live() : functions.hot();
+        pending.clear();
+        for(size_t i = hot.next(0); i != FunctionBits::End; i = hot.next(i + 1)) {
+            pending.push_back(functions[i]);
+        }
+        getRuntimeLock().unlock();
+        
+        uint64_t start = getTime();
+        
+        for(vector<Function*>::iterator iter = pending.begin(); iter != pending.end(); iter++) {
+            Function* f = *iter;
+            
+            getRuntimeLock().lock();
+            if(!shutting_down) {
+                f->prepare(CodeRegion::upcoming());
+            }
+            getRuntimeLock().unlock();
+        }
+        
+        DEBUG("Built spare copies of %lu functions in %lu us",
+            (unsigned long)pending.size(), (unsigned long)(getTime() - start));
+    }
+    
+    return NULL;
+}
+
+/**
+ * Report iTLB misses and time spent in the runtime, for comparing runs with
+ * and without huge pages
+ */
+void reportPages() {
+    fprintf(stderr, "stabilizer: %s pages, ", HugePages::enabled() ? "2MB" : "4KB");
+    
+    if(itlb_misses->isAvailable()) {
+        fprintf(stderr, "%llu iTLB misses, ", (unsigned long long)itlb_misses->read());
+    } else {
+        fprintf(stderr, "iTLB misses unavailable, ");
+    }
+    
+    fprintf(stderr, "%llu us in the runtime\n", (unsigned long long)total_overhead);
 }
 
 void setHandler(int sig, void(*fn)(int, siginfo_t*, void*)) {
     struct sigaction sa;
     sa.sa_sigaction = (void(*)(int, siginfo_t*, void*))fn;
-    sa.sa_flags = SA_SIGINFO;
+    
+    // Every epoch end stops all threads, so their blocking calls must not fail with EINTR
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    
+    // Never let the timer interrupt a handler that is relocating functions
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, Timer::getSignal());
+    
     sigaction(sig, &sa, NULL);
 }
@@ -0,0 +1,72 @@
+/**
+ * Relocation stress test: a ring of functions that recurse through each
+ * other.  Every rerandomization must walk thousands of frames, and deep frames
+ * keep old copies of every function in the ring alive, so the runtime's
+ * function location index is exercised with a large number of live copies.
+ *
+ * The ring has FUNCTIONS members (512 by default, at most 4096), so pause
+ * times can be compared across sizes by building with -DFUNCTIONS=n.  All
+ * 4096 functions are defined, but only the ring's members are ever called and
+ * relocated.  The stack depth is the same at every size.  The debug build of
+ * the runtime reports the pause time of each epoch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(FUNCTIONS)
+#define FUNCTIONS 512
+#endif
+
+#define MAX_FUNCTIONS 4096
+#define DEPTH 4096
+#define ROUNDS 20000
+
+#if FUNCTIONS < 1 || FUNCTIONS > MAX_FUNCTIONS
+#error "FUNCTIONS must be between 1 and 4096"
+#endif
+
+typedef int (*ring_fn)(int depth);
+
+/* Each function calls the next one in the ring through this table */
+static ring_fn ring[MAX_FUNCTIONS];
+
+/* Functions are named by four octal digits, so f_0017 is function 15 */
+#define F(a, b, c, d) \
+    int f_##a##b##c##d(int depth) { \
+        int id = a * 512 + b * 64 + c * 8 + d; \
+        return depth == 0 ? id : ring[(id + 1) % FUNCTIONS](depth - 1) + (depth & 1); \
+    }
+
+#define F8(a, b, c) F(a, b, c, 0) F(a, b, c, 1) F(a, b, c, 2) F(a, b, c, 3) \
+    F(a, b, c, 4) F(a, b, c, 5) F(a, b, c, 6) F(a, b, c, 7)
+#define F64(a, b) F8(a, b, 0) F8(a, b, 1) F8(a, b, 2) F8(a, b, 3) \
+    F8(a, b, 4) F8(a, b, 5) F8(a, b, 6) F8(a, b, 7)
+#define F512(a) F64(a, 0) F64(a, 1) F64(a, 2) F64(a, 3) \
+    F64(a, 4) F64(a, 5) F64(a, 6) F64(a, 7)
+
+F512(0) F512(1) F512(2) F512(3) F512(4) F512(5) F512(6) F512(7)
+
+#define R(a, b, c, d) f_##a##b##c##d,
+#define R8(a, b, c) R(a, b, c, 0) R(a, b, c, 1) R(a, b, c, 2) R(a, b, c, 3) \
+    R(a, b, c, 4) R(a, b, c, 5) R(a, b, c, 6) R(a, b, c, 7)
+#define R64(a, b) R8(a, b, 0) R8(a, b, 1) R8(a, b, 2) R8(a, b, 3) \
+    R8(a, b, 4) R8(a, b, 5) R8(a, b, 6) R8(a, b, 7)
+#define R512(a) R64(a, 0) R64(a, 1) R64(a, 2) R64(a, 3) \
+    R64(a, 4) R64(a, 5) R64(a, 6) R64(a, 7)
+
+static ring_fn ring[MAX_FUNCTIONS] = {
+    R512(0) R512(1) R512(2) R512(3) R512(4) R512(5) R512(6) R512(7)
+};
+
+int main(int argc, char** argv) {
+    long total = 0;
+    int i;
+
+    for(i=0; i<ROUNDS; i++) {
+        total += ring[0](DEPTH - (i % 64));
+    }
+
+    printf("%d functions: %ld\n", FUNCTIONS, total);
+    return 0;
+}
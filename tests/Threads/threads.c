@@ -0,0 +1,73 @@
+/**
+ * Thread scaling test: each thread repeatedly recurses through a small ring
+ * of functions, so every rerandomization has to stop and scan every thread.
+ * Run with a thread count argument; the debug build of the runtime reports
+ * the pause time of each epoch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+#define DEPTH 256
+#define ROUNDS 20000
+
+int ring0(int depth);
+int ring1(int depth);
+int ring2(int depth);
+int ring3(int depth);
+int ring4(int depth);
+int ring5(int depth);
+int ring6(int depth);
+int ring7(int depth);
+
+int ring0(int depth) { return depth == 0 ? 0 : ring1(depth - 1) + (depth & 1); }
+int ring1(int depth) { return depth == 0 ? 1 : ring2(depth - 1) + (depth & 1); }
+int ring2(int depth) { return depth == 0 ? 2 : ring3(depth - 1) + (depth & 1); }
+int ring3(int depth) { return depth == 0 ? 3 : ring4(depth - 1) + (depth & 1); }
+int ring4(int depth) { return depth == 0 ? 4 : ring5(depth - 1) + (depth & 1); }
+int ring5(int depth) { return depth == 0 ? 5 : ring6(depth - 1) + (depth & 1); }
+int ring6(int depth) { return depth == 0 ? 6 : ring7(depth - 1) + (depth & 1); }
+int ring7(int depth) { return depth == 0 ? 7 : ring0(depth - 1) + (depth & 1); }
+
+void* worker(void* arg) {
+    long* total = (long*)arg;
+    int i;
+    
+    for(i=0; i<ROUNDS; i++) {
+        *total += ring0(DEPTH - (i % 8));
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    pthread_t threads[MAX_THREADS];
+    long totals[MAX_THREADS];
+    long total = 0;
+    int count = 4;
+    int i;
+    
+    if(argc > 1) {
+        count = atoi(argv[1]);
+    }
+    
+    if(count < 1 || count > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [1-%d threads]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+    
+    for(i=0; i<count; i++) {
+        totals[i] = 0;
+        pthread_create(&threads[i], NULL, worker, &totals[i]);
+    }
+    
+    for(i=0; i<count; i++) {
+        pthread_join(threads[i], NULL);
+        total += totals[i];
+    }
+    
+    printf("%d threads: %ld\n", count, total);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Trace.h"
+
+using namespace std;
+
+/**
+ * Decodes a layout trace written by a program run with STABILIZER_TRACE set,
+ * and prints a table of placements for each epoch.
+ */
+
+struct Placement {
+    uint64_t function;
+    uint64_t copy;
+    uint64_t pad;
+};
+
+struct Epoch {
+    uint64_t time;      //< Microseconds after the trace was opened
+    bool complete;      //< False if the start of the epoch was overwritten
+    vector<Placement> moves;
+    vector<pair<uint64_t, uint64_t> > arenas;   //< Arenas mapped during the epoch
+
+    Epoch() : time(0), complete(false) {}
+};
+
+void usage() {
+    fprintf(stderr, "usage: sztrace <trace file>\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    if(argc != 2) {
+        usage();
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if((size_t)st.st_size < sizeof(Trace::Header)) {
+        fprintf(stderr, "%s: not a layout trace\n", argv[1]);
+        return 1;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    Trace::Header* h = (Trace::Header*)p;
+    Trace::Entry* entries = (Trace::Entry*)&h[1];
+
+    if(h->magic != Trace::Magic || sizeof(Trace::Header) + h->capacity * sizeof(Trace::Entry) > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a layout trace\n", argv[1]);
+        return 1;
+    }
+
+    // Only the last capacity entries are still in the ring
+    uint64_t first = h->head > h->capacity ? h->head - h->capacity : 0;
+
+    map<uint32_t, Epoch> epochs;
+
+    for(uint64_t n=first; n<h->head; n++) {
+        Trace::Entry& e = entries[n % h->capacity];
+        Epoch& epoch = epochs[e.epoch];
+
+        if(e.kind == Trace::EpochStart) {
+            epoch.time = e.a;
+            epoch.complete = true;
+
+        } else if(e.kind == Trace::Move) {
+            Placement pl = { e.a, e.b, e.c };
+            epoch.moves.push_back(pl);
+
+        } else if(e.kind == Trace::Arena) {
+            epoch.arenas.push_back(make_pair(e.a, e.b));
+        }
+    }
+
+    printf("%s: %llu entries, %lu epochs", argv[1], (unsigned long long)h->head, (unsigned long)epochs.size());
+    if(first > 0) {
+        printf(", the oldest %llu entries were overwritten", (unsigned long long)first);
+    }
+    printf("\n");
+
+    // Arenas stay mapped, so each epoch lists every arena seen so far
+    vector<pair<uint64_t, uint64_t> > arenas;
+
+    for(map<uint32_t, Epoch>::iterator iter = epochs.begin(); iter != epochs.end(); iter++) {
+        Epoch& epoch = iter->second;
+
+        arenas.insert(arenas.end(), epoch.arenas.begin(), epoch.arenas.end());
+
+        printf("\nepoch %u", iter->first);
+        if(epoch.complete) {
+            printf(" at %.3f s", epoch.time / 1000000.0);
+        } else {
+            printf(" (partial)");
+        }
+        printf(": %lu moves, %lu arenas\n", (unsigned long)epoch.moves.size(), (unsigned long)arenas.size());
+
+        if(epoch.moves.size() > 0) {
+            printf("  %-18s  %-18s  %s\n", "function", "copy", "pad");
+            for(size_t i=0; i<epoch.moves.size(); i++) {
+                Placement& pl = epoch.moves[i];
+                printf("  0x%016llx  0x%016llx  %llu\n", (unsigned long long)pl.function,
+                    (unsigned long long)pl.copy, (unsigned long long)pl.pad);
+            }
+        }
+
+        if(arenas.size() > 0) {
+            printf("  %-18s  %s\n", "arena", "size");
+            for(size_t i=0; i<arenas.size(); i++) {
+                printf("  0x%016llx  %llu KB\n", (unsigned long long)arenas[i].first,
+                    (unsigned long long)arenas[i].second / 1024);
+            }
+        }
+    }
+
+    munmap(p, st.st_size);
+    close(fd);
+
+    return 0;
+}